@@ -0,0 +1,95 @@
+#include "bake.hpp"
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define BAKE_BLOCK 256 // vertices a worker claims at a time
+#define BAKE_OFFSET 0.25f // rays start this far off the surface, clear of it
+
+// per vertex and sample, so the result doesn't depend on the thread count
+static inline f32 hashUnit(u32 a, u32 b) {
+	u32 h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u) * 0x85EBCA77u;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	h *= 0x297A2D39u;
+	h ^= h >> 15;
+	return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// cosine-weighted direction about the unit normal n
+static mesh_v3 hemisphereSample(const mesh_v3& n, f32 u1, f32 u2) {
+	mesh_v3 t = fabsf(n.x) > 0.9f ? mesh_v3{0, 1, 0} : mesh_v3{1, 0, 0};
+	mesh_v3 b = cross(n, t);
+	b.normalize();
+	t = cross(b, n);
+	f32 r = sqrtf(u1), phi = 6.2831853f * u2;
+	return t * (r * cosf(phi)) + b * (r * sinf(phi)) + n * sqrtf(1 - u1);
+}
+
+static f32 directLight(const Mesh& mesh, const BVH& occluders, const mesh_v3& p, const mesh_v3& n,
+	const bake_options& opts)
+{
+	f32 total = opts.minLight;
+	for (const auto& l: mesh.lights) {
+		mesh_v3 to = mesh_v3{l.x, l.y, l.z} - p;
+		f32 dist = sqrtf(dot(to, to));
+		if (dist >= l.level || dist <= 0) continue;
+		f32 cosine = dot(to, n) / dist;
+		if (cosine <= 0) continue; // behind the surface
+
+		f32 o[3] = { p.x, p.y, p.z }, d[3] = { to.x, to.y, to.z };
+		if (occluders.raycast(o, d, 1, NULL)) continue;
+		total += (l.level - dist) * (0.5f + 0.5f * cosine);
+	}
+	return std::min(total / 255.0f, 1.0f);
+}
+
+static f32 occlusion(const BVH& occluders, u32 vertex, const mesh_v3& p, const mesh_v3& n, const bake_options& opts) {
+	if (opts.aoSamples <= 0) return 1;
+	int open = 0;
+	f32 o[3] = { p.x, p.y, p.z };
+	for (int s = 0; s < opts.aoSamples; s++) {
+		mesh_v3 dir = hemisphereSample(n, hashUnit(vertex, s * 2), hashUnit(vertex, s * 2 + 1));
+		f32 d[3] = { dir.x, dir.y, dir.z };
+		if (!occluders.raycast(o, d, opts.aoDistance, NULL)) open++;
+	}
+	return (f32)open / opts.aoSamples;
+}
+
+void bakeVertexColors(Mesh& mesh, const BVH& occluders, const bake_options& opts)
+{
+	// a vertex belongs to one face group, and so has that group's normal
+	std::vector<mesh_v3> vnormals(mesh.vertices.size());
+	for (const auto& g: mesh.groups) {
+		mesh_v3 n = mesh.normals[g.normal];
+		for (u32 i = g.firstIndex; i < g.firstIndex + g.numTris * 3; i++) vnormals[mesh.indices[i]] = n;
+	}
+
+	mesh.colors.assign(mesh.vertices.size(), mesh_v3{1, 1, 1});
+	bool lit = !mesh.lights.empty();
+	u32 count = (u32)mesh.vertices.size();
+	std::atomic<u32> next(0);
+	auto work = [&]() {
+		for (u32 first = next.fetch_add(BAKE_BLOCK); first < count; first = next.fetch_add(BAKE_BLOCK)) {
+			u32 last = std::min(count, first + BAKE_BLOCK);
+			for (u32 v = first; v < last; v++) {
+				const mesh_v3& n = vnormals[v];
+				if (!n.nonZero()) continue;
+				mesh_v3 p = mesh.vertices[v] + n * BAKE_OFFSET;
+				f32 light = lit ? directLight(mesh, occluders, p, n, opts) : 1;
+				f32 c = light * occlusion(occluders, v, p, n, opts);
+				mesh.colors[v] = mesh_v3{c, c, c};
+			}
+		}
+	};
+
+	int threads = opts.threads > 0 ? opts.threads : (int)std::thread::hardware_concurrency();
+	threads = std::max(1, std::min(threads, (int)(count / BAKE_BLOCK) + 1));
+	std::vector<std::thread> workers;
+	for (int t = 1; t < threads; t++) workers.emplace_back(work);
+	work();
+	for (auto& w: workers) w.join();
+}
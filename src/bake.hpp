@@ -0,0 +1,25 @@
+#ifndef BAKE_H_INCLUDED
+#define BAKE_H_INCLUDED
+
+#include "common.h"
+#include "mesh.hpp"
+#include "bvh.hpp"
+
+struct bake_options {
+	int aoSamples = 32; // hemisphere rays per vertex; 0 bakes light alone
+	f32 aoDistance = 64; // map units; anything nearer than this occludes
+	f32 minLight = 16; // ambient on the lights' scale, where 255 is full
+	int threads = 0; // 0 picks one per core
+};
+
+// Fills mesh.colors with each vertex's direct light from mesh.lights, shadowed
+// by the occluders, times its ambient occlusion. Works in map units, so bake
+// before the mesh is scaled. A map with no lights is taken as fully lit and
+// gets the occlusion alone.
+//
+// Lighting follows the original light tool: a light of level L adds
+// (L - distance) * (0.5 + 0.5 * cos) on the 0-255 scale, 0.5 + 0.5 * cos
+// softening the falloff across a surface.
+void bakeVertexColors(Mesh& mesh, const BVH& occluders, const bake_options& opts);
+
+#endif
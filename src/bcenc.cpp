@@ -0,0 +1,464 @@
+#include "bcenc.hpp"
+#include "common.h"
+#include <math.h>
+#include <string.h>
+
+static const f32 bc1Weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f }; // fraction of c1
+static const int bc7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+size_t blockCompressedSize(const BlockFormat fmt, const int w, const int h)
+{
+	size_t blocks = (size_t)((w + 3) / 4) * (size_t)((h + 3) / 4);
+	return blocks * (fmt == BlockFormat::BC1 ? 8 : 16);
+}
+
+static void fetchBlock(const unsigned char* rgba, const int w, const int h, const int bx, const int by, unsigned char px[16][4])
+{
+	for (int y = 0; y < 4; y++) {
+		int sy = by * 4 + y;
+		if (sy >= h) sy = h - 1;
+		for (int x = 0; x < 4; x++) {
+			int sx = bx * 4 + x;
+			if (sx >= w) sx = w - 1;
+			memcpy(px[y * 4 + x], rgba + (sy * w + sx) * 4, 4);
+		}
+	}
+}
+
+static f32 clampf(const f32 v, const f32 lo, const f32 hi) {
+	return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Endpoints along the principal axis of the points (power iteration on the
+// covariance), or the bounding box diagonal for the fast path.
+static void fitEndpoints(const f32 pts[][4], const int n, const int ch, const bool fast, f32* e0, f32* e1)
+{
+	f32 mean[4] = {0, 0, 0, 0};
+	f32 mn[4] = {255, 255, 255, 255};
+	f32 mx[4] = {0, 0, 0, 0};
+	for (int i = 0; i < n; i++) {
+		for (int c = 0; c < ch; c++) {
+			mean[c] += pts[i][c];
+			mn[c] = fminf(mn[c], pts[i][c]);
+			mx[c] = fmaxf(mx[c], pts[i][c]);
+		}
+	}
+	for (int c = 0; c < ch; c++) mean[c] /= n;
+
+	if (fast) {
+		// inset the box a little; the extremes are rarely worth an endpoint
+		for (int c = 0; c < ch; c++) {
+			f32 inset = (mx[c] - mn[c]) / 16.0f;
+			e0[c] = mx[c] - inset;
+			e1[c] = mn[c] + inset;
+		}
+		return;
+	}
+
+	f32 cov[4][4] = {{0}};
+	for (int i = 0; i < n; i++) {
+		for (int a = 0; a < ch; a++) {
+			for (int b = 0; b < ch; b++) {
+				cov[a][b] += (pts[i][a] - mean[a]) * (pts[i][b] - mean[b]);
+			}
+		}
+	}
+
+	f32 axis[4];
+	for (int c = 0; c < ch; c++) axis[c] = mx[c] - mn[c];
+	for (int iter = 0; iter < 8; iter++) {
+		f32 next[4] = {0, 0, 0, 0};
+		f32 largest = 0;
+		for (int a = 0; a < ch; a++) {
+			for (int b = 0; b < ch; b++) next[a] += cov[a][b] * axis[b];
+			largest = fmaxf(largest, fabsf(next[a]));
+		}
+		if (largest < 1e-6f) break;
+		for (int c = 0; c < ch; c++) axis[c] = next[c] / largest;
+	}
+
+	f32 alen = 0;
+	for (int c = 0; c < ch; c++) alen += axis[c] * axis[c];
+	if (alen < 1e-12f) {
+		for (int c = 0; c < ch; c++) e0[c] = e1[c] = mean[c];
+		return;
+	}
+	alen = sqrtf(alen);
+	for (int c = 0; c < ch; c++) axis[c] /= alen;
+
+	f32 tmin = 0, tmax = 0;
+	for (int i = 0; i < n; i++) {
+		f32 t = 0;
+		for (int c = 0; c < ch; c++) t += (pts[i][c] - mean[c]) * axis[c];
+		tmin = fminf(tmin, t);
+		tmax = fmaxf(tmax, t);
+	}
+	for (int c = 0; c < ch; c++) {
+		e0[c] = clampf(mean[c] + axis[c] * tmax, 0, 255);
+		e1[c] = clampf(mean[c] + axis[c] * tmin, 0, 255);
+	}
+}
+
+// Least-squares endpoints for fixed index weights: x ~ (1-t)*e0 + t*e1.
+static bool refineEndpoints(const f32 pts[][4], const int n, const int ch, const f32* t, f32* e0, f32* e1)
+{
+	f32 aa = 0, ab = 0, bb = 0;
+	f32 ax[4] = {0, 0, 0, 0}, bx[4] = {0, 0, 0, 0};
+	for (int i = 0; i < n; i++) {
+		f32 b = t[i], a = 1.0f - b;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		for (int c = 0; c < ch; c++) {
+			ax[c] += a * pts[i][c];
+			bx[c] += b * pts[i][c];
+		}
+	}
+	f32 det = aa * bb - ab * ab;
+	if (fabsf(det) < 1e-6f) return false;
+	for (int c = 0; c < ch; c++) {
+		e0[c] = clampf((ax[c] * bb - bx[c] * ab) / det, 0, 255);
+		e1[c] = clampf((bx[c] * aa - ax[c] * ab) / det, 0, 255);
+	}
+	return true;
+}
+
+// BC1 color ---------------------------------------------------------------
+
+static u16 pack565(const f32* c) {
+	int r = (int)(clampf(c[0], 0, 255) * 31.0f / 255.0f + 0.5f);
+	int g = (int)(clampf(c[1], 0, 255) * 63.0f / 255.0f + 0.5f);
+	int b = (int)(clampf(c[2], 0, 255) * 31.0f / 255.0f + 0.5f);
+	return (u16)((r << 11) | (g << 5) | b);
+}
+
+static void unpack565(const u16 v, int* rgb) {
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+// assigns four-color-mode indices and returns the squared error
+static f32 bc1Assign(const f32 pts[][4], const int n, const u16 c0, const u16 c1, unsigned char* idx)
+{
+	int pal[4][3];
+	unpack565(c0, pal[0]);
+	unpack565(c1, pal[1]);
+	for (int c = 0; c < 3; c++) {
+		pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+		pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+	}
+	int choices = (c0 == c1) ? 1 : 4; // equal endpoints decode as 3-color mode
+
+	f32 total = 0;
+	for (int i = 0; i < n; i++) {
+		f32 best = 1e30f;
+		int besti = 0;
+		for (int k = 0; k < choices; k++) {
+			f32 d = 0;
+			for (int c = 0; c < 3; c++) {
+				f32 e = pts[i][c] - pal[k][c];
+				d += e * e;
+			}
+			if (d < best) { best = d; besti = k; }
+		}
+		idx[i] = besti;
+		total += best;
+	}
+	return total;
+}
+
+static void bc1Quantize(const f32* e0, const f32* e1, u16* c0, u16* c1) {
+	*c0 = pack565(e0);
+	*c1 = pack565(e1);
+	if (*c0 < *c1) { u16 t = *c0; *c0 = *c1; *c1 = t; }
+}
+
+// alphaAware leaves transparent texels out of the fit, since BC3 decodes
+// their color but nothing will ever show it
+static void encodeColorBlock(const unsigned char px[16][4], const bool alphaAware, const BlockQuality quality, unsigned char* out)
+{
+	f32 all[16][4], pts[16][4];
+	int n = 0;
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 4; c++) all[i][c] = px[i][c];
+		if (!alphaAware || px[i][3] >= 128) {
+			memcpy(pts[n++], all[i], sizeof(all[i]));
+		}
+	}
+	if (n == 0) {
+		memcpy(pts, all, sizeof(all));
+		n = 16;
+	}
+
+	f32 e0[4], e1[4];
+	fitEndpoints(pts, n, 3, quality == BlockQuality::Fast, e0, e1);
+
+	u16 c0, c1;
+	unsigned char idx[16];
+	bc1Quantize(e0, e1, &c0, &c1);
+	f32 err = bc1Assign(pts, n, c0, c1, idx);
+
+	int passes = quality == BlockQuality::High ? 4 : (quality == BlockQuality::Normal ? 1 : 0);
+	for (int p = 0; p < passes; p++) {
+		f32 t[16];
+		for (int i = 0; i < n; i++) t[i] = bc1Weights[idx[i]];
+		f32 r0[4], r1[4];
+		if (!refineEndpoints(pts, n, 3, t, r0, r1)) break;
+
+		u16 n0, n1;
+		unsigned char nidx[16];
+		bc1Quantize(r0, r1, &n0, &n1);
+		f32 nerr = bc1Assign(pts, n, n0, n1, nidx);
+		if (nerr >= err) break;
+		c0 = n0; c1 = n1; err = nerr;
+		memcpy(idx, nidx, sizeof(idx));
+	}
+
+	// final indices cover every texel, including the ones left out of the fit
+	unsigned char blockidx[16];
+	bc1Assign(all, 16, c0, c1, blockidx);
+
+	unsigned int bits = 0;
+	for (int i = 0; i < 16; i++) bits |= (unsigned int)blockidx[i] << (i * 2);
+	out[0] = c0 & 0xff; out[1] = c0 >> 8;
+	out[2] = c1 & 0xff; out[3] = c1 >> 8;
+	out[4] = bits & 0xff; out[5] = (bits >> 8) & 0xff;
+	out[6] = (bits >> 16) & 0xff; out[7] = (bits >> 24) & 0xff;
+}
+
+// BC3 alpha ---------------------------------------------------------------
+
+static int alphaAssign(const unsigned char px[16][4], const int a0, const int a1, unsigned char* idx)
+{
+	int pal[8];
+	pal[0] = a0;
+	pal[1] = a1;
+	if (a0 > a1) {
+		for (int k = 2; k < 8; k++) pal[k] = ((8 - k) * a0 + (k - 1) * a1) / 7;
+	} else {
+		for (int k = 2; k < 6; k++) pal[k] = ((6 - k) * a0 + (k - 1) * a1) / 5;
+		pal[6] = 0;
+		pal[7] = 255;
+	}
+
+	int total = 0;
+	for (int i = 0; i < 16; i++) {
+		int best = 1 << 30, besti = 0;
+		for (int k = 0; k < 8; k++) {
+			int d = (px[i][3] - pal[k]) * (px[i][3] - pal[k]);
+			if (d < best) { best = d; besti = k; }
+		}
+		idx[i] = besti;
+		total += best;
+	}
+	return total;
+}
+
+static void encodeAlphaBlock(const unsigned char px[16][4], const BlockQuality quality, unsigned char* out)
+{
+	int mn = 255, mx = 0;
+	int inner_mn = 255, inner_mx = 0; // ignoring 0 and 255, which 6-value mode has for free
+	for (int i = 0; i < 16; i++) {
+		int a = px[i][3];
+		if (a < mn) mn = a;
+		if (a > mx) mx = a;
+		if (a > 0 && a < 255) {
+			if (a < inner_mn) inner_mn = a;
+			if (a > inner_mx) inner_mx = a;
+		}
+	}
+
+	int a0 = mx, a1 = mn;
+	unsigned char idx[16];
+	int err = alphaAssign(px, a0, a1, idx);
+
+	if (quality != BlockQuality::Fast) {
+		if (inner_mn > inner_mx) { inner_mn = 0; inner_mx = 0; } // only 0/255 present
+		unsigned char idx6[16];
+		int err6 = alphaAssign(px, inner_mn, inner_mx, idx6);
+		if (err6 < err) {
+			a0 = inner_mn; a1 = inner_mx; err = err6;
+			memcpy(idx, idx6, sizeof(idx));
+		}
+	}
+
+	out[0] = a0;
+	out[1] = a1;
+	unsigned long long bits = 0;
+	for (int i = 0; i < 16; i++) bits |= (unsigned long long)idx[i] << (i * 3);
+	for (int b = 0; b < 6; b++) out[2 + b] = (bits >> (b * 8)) & 0xff;
+}
+
+// BC7 mode 6 --------------------------------------------------------------
+
+static void putBits(unsigned char* out, int* pos, unsigned int value, const int nbits)
+{
+	for (int b = 0; b < nbits; b++) {
+		if (value & (1u << b)) out[(*pos) >> 3] |= 1 << ((*pos) & 7);
+		(*pos)++;
+	}
+}
+
+static void bc7Expand(const int q[2][4], const int p[2], int ep[2][4]) {
+	for (int e = 0; e < 2; e++) {
+		for (int c = 0; c < 4; c++) ep[e][c] = (q[e][c] << 1) | p[e];
+	}
+}
+
+static f32 bc7Assign(const f32 pts[16][4], const int q[2][4], const int p[2], unsigned char* idx)
+{
+	int ep[2][4];
+	bc7Expand(q, p, ep);
+	int pal[16][4];
+	for (int k = 0; k < 16; k++) {
+		for (int c = 0; c < 4; c++) {
+			pal[k][c] = ((64 - bc7Weights[k]) * ep[0][c] + bc7Weights[k] * ep[1][c] + 32) >> 6;
+		}
+	}
+
+	f32 total = 0;
+	for (int i = 0; i < 16; i++) {
+		f32 best = 1e30f;
+		int besti = 0;
+		for (int k = 0; k < 16; k++) {
+			f32 d = 0;
+			for (int c = 0; c < 4; c++) {
+				f32 e = pts[i][c] - pal[k][c];
+				d += e * e;
+			}
+			if (d < best) { best = d; besti = k; }
+		}
+		idx[i] = besti;
+		total += best;
+	}
+	return total;
+}
+
+static void bc7Quantize(const f32* e, const int p, int* q) {
+	for (int c = 0; c < 4; c++) {
+		int v = (int)floorf((e[c] - p) / 2.0f + 0.5f);
+		q[c] = v < 0 ? 0 : (v > 127 ? 127 : v);
+	}
+}
+
+// picks the endpoint p-bits: every combination for the better modes,
+// otherwise whichever reproduces each endpoint closer on its own
+static f32 bc7FitPBits(const f32 pts[16][4], const f32* e0, const f32* e1, const bool fast,
+	int q[2][4], int p[2], unsigned char* idx)
+{
+	if (fast) {
+		const f32* e[2] = { e0, e1 };
+		for (int k = 0; k < 2; k++) {
+			f32 best = 1e30f;
+			for (int pb = 0; pb < 2; pb++) {
+				int tq[4];
+				bc7Quantize(e[k], pb, tq);
+				f32 d = 0;
+				for (int c = 0; c < 4; c++) {
+					f32 diff = e[k][c] - ((tq[c] << 1) | pb);
+					d += diff * diff;
+				}
+				if (d < best) { best = d; p[k] = pb; memcpy(q[k], tq, sizeof(tq)); }
+			}
+		}
+		return bc7Assign(pts, q, p, idx);
+	}
+
+	f32 best = 1e30f;
+	for (int combo = 0; combo < 4; combo++) {
+		int tp[2] = { combo & 1, combo >> 1 };
+		int tq[2][4];
+		unsigned char tidx[16];
+		bc7Quantize(e0, tp[0], tq[0]);
+		bc7Quantize(e1, tp[1], tq[1]);
+		f32 err = bc7Assign(pts, tq, tp, tidx);
+		if (err < best) {
+			best = err;
+			memcpy(q, tq, sizeof(tq));
+			p[0] = tp[0]; p[1] = tp[1];
+			memcpy(idx, tidx, 16);
+		}
+	}
+	return best;
+}
+
+static void encodeBC7Block(const unsigned char px[16][4], const BlockQuality quality, unsigned char* out)
+{
+	f32 pts[16][4];
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 4; c++) pts[i][c] = px[i][c];
+	}
+
+	const bool fast = quality == BlockQuality::Fast;
+	f32 e0[4], e1[4];
+	fitEndpoints(pts, 16, 4, fast, e0, e1);
+
+	int q[2][4], p[2];
+	unsigned char idx[16];
+	f32 err = bc7FitPBits(pts, e0, e1, fast, q, p, idx);
+
+	int passes = quality == BlockQuality::High ? 3 : 0;
+	for (int pass = 0; pass < passes; pass++) {
+		f32 t[16];
+		for (int i = 0; i < 16; i++) t[i] = bc7Weights[idx[i]] / 64.0f;
+		f32 r0[4], r1[4];
+		if (!refineEndpoints(pts, 16, 4, t, r0, r1)) break;
+
+		int nq[2][4], np[2];
+		unsigned char nidx[16];
+		f32 nerr = bc7FitPBits(pts, r0, r1, false, nq, np, nidx);
+		if (nerr >= err) break;
+		err = nerr;
+		memcpy(q, nq, sizeof(q));
+		p[0] = np[0]; p[1] = np[1];
+		memcpy(idx, nidx, sizeof(idx));
+	}
+
+	// the first index's top bit is implied zero, so flip the endpoints if needed
+	if (idx[0] & 8) {
+		for (int c = 0; c < 4; c++) { int tmp = q[0][c]; q[0][c] = q[1][c]; q[1][c] = tmp; }
+		int tmp = p[0]; p[0] = p[1]; p[1] = tmp;
+		for (int i = 0; i < 16; i++) idx[i] = 15 - idx[i];
+	}
+
+	memset(out, 0, 16);
+	int pos = 0;
+	putBits(out, &pos, 1 << 6, 7); // mode 6
+	for (int c = 0; c < 4; c++) {
+		putBits(out, &pos, q[0][c], 7);
+		putBits(out, &pos, q[1][c], 7);
+	}
+	putBits(out, &pos, p[0], 1);
+	putBits(out, &pos, p[1], 1);
+	putBits(out, &pos, idx[0], 3);
+	for (int i = 1; i < 16; i++) putBits(out, &pos, idx[i], 4);
+}
+
+void compressBlocks(const unsigned char* rgba, const int w, const int h,
+	const BlockFormat fmt, const BlockQuality quality, unsigned char* out)
+{
+	const int bw = (w + 3) / 4, bh = (h + 3) / 4;
+	const int stride = fmt == BlockFormat::BC1 ? 8 : 16;
+
+	unsigned char px[16][4];
+	for (int by = 0; by < bh; by++) {
+		for (int bx = 0; bx < bw; bx++) {
+			unsigned char* block = out + (by * bw + bx) * stride;
+			fetchBlock(rgba, w, h, bx, by, px);
+			switch (fmt) {
+				case BlockFormat::BC1:
+					encodeColorBlock(px, false, quality, block);
+					break;
+				case BlockFormat::BC3:
+					encodeAlphaBlock(px, quality, block);
+					encodeColorBlock(px, true, quality, block + 8);
+					break;
+				case BlockFormat::BC7:
+					encodeBC7Block(px, quality, block);
+					break;
+			}
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef BCENC_H_INCLUDED
+#define BCENC_H_INCLUDED
+
+#include <stddef.h>
+
+enum class BlockFormat {
+	BC1,	// opaque RGB, 8 bytes per 4x4 block
+	BC3,	// RGB + interpolated alpha, 16 bytes per block
+	BC7		// RGBA, mode 6 only, 16 bytes per block
+};
+
+enum class BlockQuality {
+	Fast,	// bounding-box endpoints
+	Normal,	// principal-axis endpoints, one refinement pass
+	High	// principal-axis endpoints, iterated least-squares refinement
+};
+
+struct bc_options {
+	BlockFormat opaque = BlockFormat::BC1;
+	BlockFormat keyed = BlockFormat::BC3;	// '{' textures, index 255 is transparent
+	BlockQuality quality = BlockQuality::Normal;
+	int threads = 0;	// 0 picks one per core
+};
+
+size_t blockCompressedSize(const BlockFormat fmt, const int w, const int h);
+
+// Encodes a w*h RGBA8 image into 4x4 blocks, row-major. Partial blocks at the
+// right and bottom edges repeat the last row/column.
+void compressBlocks(const unsigned char* rgba, const int w, const int h,
+	const BlockFormat fmt, const BlockQuality quality, unsigned char* out);
+
+#endif
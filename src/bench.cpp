@@ -0,0 +1,443 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include "bspdata.hpp"
+#include "mesh.hpp"
+#include "bvh.hpp"
+#include "bake.hpp"
+#include "meshfile.hpp"
+#include <math.h>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+
+// Every operator new goes through here so a run can show how many heap
+// allocations a phase performed. Only C++ allocations are counted: the
+// malloc, calloc and posix_memalign calls behind the lumps and the vertex
+// streams aren't. Other threads (the parallel modes) allocate too, hence
+// the atomic.
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t n) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(n > 0 ? n : 1);
+	if (p == NULL) throw std::bad_alloc();
+	return p;
+}
+void* operator new[](size_t n) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(n > 0 ? n : 1);
+	if (p == NULL) throw std::bad_alloc();
+	return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+
+static double now_ms() {
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void benchBuild(bspdata* bsp, int iterations) {
+	double best = 0;
+	size_t allocs = 0, groups = 0, tris = 0;
+	for (int i = 0; i < iterations; i++) {
+		size_t before = allocations.load(std::memory_order_relaxed);
+		double t0 = now_ms();
+		Mesh mesh = Mesh::FromBSPData(bsp);
+		double t = now_ms() - t0;
+		allocs = allocations.load(std::memory_order_relaxed) - before;
+		groups = mesh.groups.size();
+		tris = mesh.indices.size() / 3;
+		if (i == 0 || t < best) best = t;
+	}
+	printf("build: %i faces, %lu groups, %lu triangles\n", bsp->numFaces,
+		(unsigned long)groups, (unsigned long)tris);
+	printf("  best of %i: %.3f ms (%.1f ns/face)\n", iterations, best,
+		best * 1e6 / (bsp->numFaces > 0 ? bsp->numFaces : 1));
+	printf("  operator new calls: %lu per build, %.4f per face (C allocators not counted)\n", (unsigned long)allocs,
+		(double)allocs / (bsp->numFaces > 0 ? bsp->numFaces : 1));
+}
+
+// xorshift, so every run fires the same rays
+static f32 nextRandom(unsigned int* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return (*state & 0xFFFFFF) / (f32)0x1000000;
+}
+
+static void benchBVH(bspdata* bsp, int iterations) {
+	Mesh mesh = Mesh::FromBSPData(bsp);
+	int cores = (int)std::thread::hardware_concurrency();
+	if (cores < 1) cores = 1;
+
+	BVH bvh;
+	double serial = 0, parallel = 0;
+	for (int i = 0; i < iterations; i++) {
+		double t0 = now_ms();
+		bvh.build(mesh, 1);
+		double t1 = now_ms();
+		bvh.build(mesh, cores);
+		double t2 = now_ms();
+		if (i == 0 || t1 - t0 < serial) serial = t1 - t0;
+		if (i == 0 || t2 - t1 < parallel) parallel = t2 - t1;
+	}
+	printf("bvh: %u triangles, %u nodes, depth %i\n", bvh.triangleCount(), bvh.nodeCount(), bvh.depth());
+	printf("  build, best of %i: %.3f ms on 1 thread, %.3f ms on %i\n", iterations, serial, parallel, cores);
+
+	// rays are cast against the file as a consumer would see it
+	char path[] = "/tmp/bsp2obj-bench-XXXXXX";
+	int fd = mkstemp(path);
+	FILE* fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	bool written = fp != NULL && bvh.write(fp);
+	if (fp != NULL) written = fclose(fp) == 0 && written;
+	BVH loaded;
+	double t0 = now_ms();
+	bool opened = written && loaded.open(path);
+	double openms = now_ms() - t0;
+	unlink(path);
+	if (!opened) {
+		fprintf(stderr, "Couldn't round-trip the BVH through %s.\n", path);
+		return;
+	}
+	printf("  load: %.3f ms\n", openms);
+
+	mesh_v3 bmin, bmax;
+	mesh.getBoundingBox(&bmin, &bmax);
+	mesh_v3 extent = bmax - bmin;
+	const int nrays = 1000000;
+	unsigned int state = 12345;
+	int hits = 0;
+	t0 = now_ms();
+	for (int r = 0; r < nrays; r++) {
+		f32 o[3] = { bmin.x + extent.x * nextRandom(&state), bmin.y + extent.y * nextRandom(&state),
+			bmin.z + extent.z * nextRandom(&state) };
+		f32 d[3] = { nextRandom(&state) - 0.5f, nextRandom(&state) - 0.5f, nextRandom(&state) - 0.5f };
+		bvh_hit hit;
+		if (loaded.raycast(o, d, 1e30f, &hit)) hits++;
+	}
+	double rayms = now_ms() - t0;
+	printf("  raycast: %i rays in %.3f ms (%.2f Mrays/s, one thread), %i hit\n", nrays, rayms,
+		nrays / (rayms * 1000), hits);
+}
+
+static void benchQuery(bspdata* bsp, int iterations) {
+	if (bsp->numModels == 0) return;
+	const dmodel_t& world = bsp->models[0];
+	const int n = 1000000;
+	f32* points = (f32*)malloc(n * 3 * sizeof(f32));
+	f32* ends = (f32*)malloc(n * 3 * sizeof(f32));
+	unsigned int state = 54321;
+	for (int i = 0; i < n * 3; i++) {
+		int c = i % 3;
+		f32 span = world.maxs[c] - world.mins[c];
+		points[i] = world.mins[c] + span * nextRandom(&state);
+		ends[i] = world.mins[c] + span * nextRandom(&state);
+	}
+	int cores = (int)std::thread::hardware_concurrency();
+	if (cores < 1) cores = 1;
+
+	int* contents = (int*)malloc(n * sizeof(int));
+	bsp_trace* traces = (bsp_trace*)malloc(n * sizeof(bsp_trace));
+	printf("query: %i nodes, %i clipnodes, %i random points and segments in the world's bounds\n",
+		bsp->numNodes, bsp->numClipNodes, n);
+	for (int hull = 0; hull < 3; hull++) {
+		double pointsMs = 0, tracesMs = 0, batchMs = 0;
+		int solid = 0, blocked = 0;
+		for (int it = 0; it < iterations; it++) {
+			double t0 = now_ms();
+			for (int i = 0; i < n; i++) contents[i] = bsp->pointContents(&points[i * 3], hull);
+			double t1 = now_ms();
+			for (int i = 0; i < n; i++) bsp->trace(&points[i * 3], &ends[i * 3], hull, &traces[i]);
+			double t2 = now_ms();
+			bsp->traceBatch(points, ends, n, hull, traces, 0, cores);
+			double t3 = now_ms();
+			if (it == 0 || t1 - t0 < pointsMs) pointsMs = t1 - t0;
+			if (it == 0 || t2 - t1 < tracesMs) tracesMs = t2 - t1;
+			if (it == 0 || t3 - t2 < batchMs) batchMs = t3 - t2;
+		}
+		for (int i = 0; i < n; i++) {
+			if (contents[i] == CONTENTS_SOLID) solid++;
+			if (traces[i].fraction < 1) blocked++;
+		}
+		printf("  hull %i: points %.2f Mq/s (%i solid), traces %.2f Mq/s (%i blocked), batched on %i threads %.2f Mq/s\n",
+			hull, n / (pointsMs * 1000), solid, n / (tracesMs * 1000), blocked, cores, n / (batchMs * 1000));
+	}
+	free(points);
+	free(ends);
+	free(contents);
+	free(traces);
+}
+
+static void benchBake(bspdata* bsp, int iterations) {
+	Mesh mesh = Mesh::FromBSPData(bsp);
+	int cores = (int)std::thread::hardware_concurrency();
+	if (cores < 1) cores = 1;
+	BVH bvh;
+	bvh.build(mesh, cores);
+
+	bake_options opts;
+	double serial = 0, parallel = 0;
+	for (int i = 0; i < iterations; i++) {
+		opts.threads = 1;
+		double t0 = now_ms();
+		bakeVertexColors(mesh, bvh, opts);
+		double t1 = now_ms();
+		opts.threads = cores;
+		bakeVertexColors(mesh, bvh, opts);
+		double t2 = now_ms();
+		if (i == 0 || t1 - t0 < serial) serial = t1 - t0;
+		if (i == 0 || t2 - t1 < parallel) parallel = t2 - t1;
+	}
+	double rays = (double)mesh.vertices.size() * (opts.aoSamples + mesh.lights.size());
+	printf("bake: %lu vertices, %lu lights, %i occlusion rays each\n", (unsigned long)mesh.vertices.size(),
+		(unsigned long)mesh.lights.size(), opts.aoSamples);
+	printf("  best of %i: %.3f ms on 1 thread (%.2f Mrays/s), %.3f ms on %i (%.2f Mrays/s)\n", iterations,
+		serial, rays / (serial * 1000), parallel, cores, rays / (parallel * 1000));
+}
+
+// the OBJ, formatted on threads threads, into a file that's handed back
+static FILE* writeTimed(Mesh& mesh, const obj_options& o, double* ms) {
+	FILE* fp = tmpfile();
+	FILE* mp = fopen("/dev/null", "w");
+	if (fp == NULL || mp == NULL) {
+		if (fp != NULL) fclose(fp);
+		if (mp != NULL) fclose(mp);
+		return NULL;
+	}
+	double t0 = now_ms();
+	mesh.writeOBJ(fp, mp, "bench.mtl", "textures", "tga", o);
+	*ms = now_ms() - t0;
+	fclose(mp);
+	return fp;
+}
+
+static bool sameContents(FILE* a, FILE* b) {
+	rewind(a);
+	rewind(b);
+	char ba[65536], bb[65536];
+	while (true) {
+		size_t na = fread(ba, 1, sizeof(ba), a), nb = fread(bb, 1, sizeof(bb), b);
+		if (na != nb || memcmp(ba, bb, na) != 0) return false;
+		if (na == 0) return true;
+	}
+}
+
+static void benchWrite(bspdata* bsp, int iterations) {
+	Mesh mesh = Mesh::FromBSPData(bsp);
+	// the face section alone: the same mesh with no v or vt lines to write
+	Mesh faces = Mesh::FromBSPData(bsp);
+	faces.vertices.clear();
+	faces.texcoords.clear();
+	int cores = (int)std::thread::hardware_concurrency();
+	if (cores < 1) cores = 1;
+
+	obj_options serialOpts, parallelOpts, compactOpts;
+	serialOpts.threads = 1;
+	parallelOpts.threads = cores;
+	compactOpts.compact = true;
+	compactOpts.threads = cores;
+
+	double serial = 0, parallel = 0, compact = 0, faceSerial = 0, faceParallel = 0;
+	bool same = true;
+	long bytes = 0, compactBytes = 0;
+	for (int i = 0; i < iterations; i++) {
+		double ms1, msn, msc, msf1, msfn;
+		FILE* f1 = writeTimed(faces, serialOpts, &msf1);
+		FILE* fn = writeTimed(faces, parallelOpts, &msfn);
+		same = same && f1 != NULL && fn != NULL && sameContents(f1, fn);
+		if (f1 != NULL) fclose(f1);
+		if (fn != NULL) fclose(fn);
+		if (i == 0 || msf1 < faceSerial) faceSerial = msf1;
+		if (i == 0 || msfn < faceParallel) faceParallel = msfn;
+
+		FILE* small = writeTimed(mesh, compactOpts, &msc);
+		if (small != NULL) {
+			compactBytes = ftell(small);
+			fclose(small);
+		}
+		if (i == 0 || msc < compact) compact = msc;
+
+		FILE* one = writeTimed(mesh, serialOpts, &ms1);
+		FILE* many = writeTimed(mesh, parallelOpts, &msn);
+		if (one == NULL || many == NULL) {
+			fprintf(stderr, "Couldn't open a scratch file.\n");
+			if (one != NULL) fclose(one);
+			if (many != NULL) fclose(many);
+			return;
+		}
+		bytes = ftell(one);
+		same = same && sameContents(one, many);
+		fclose(one);
+		fclose(many);
+		if (i == 0 || ms1 < serial) serial = ms1;
+		if (i == 0 || msn < parallel) parallel = msn;
+	}
+	printf("write: %ld bytes of OBJ, %s on every thread count\n", bytes, same ? "identical" : "DIFFERENT");
+	printf("  best of %i: %.3f ms on 1 thread (%.1f MB/s), %.3f ms on %i (%.1f MB/s), %.2fx\n", iterations,
+		serial, bytes / (serial * 1000), parallel, cores, bytes / (parallel * 1000), serial / parallel);
+	printf("  faces alone: %lu triangles, %.3f ms on 1 thread, %.3f ms on %i, %.2fx\n",
+		(unsigned long)faces.indices.size() / 3, faceSerial, faceParallel, cores, faceSerial / faceParallel);
+	printf("  compact: %ld bytes (%.1f%% smaller), %.3f ms on %i\n", compactBytes,
+		bytes > 0 ? 100.0 * (bytes - compactBytes) / bytes : 0.0, compact, cores);
+}
+
+// grows a malloc'd array to hold at least n more values
+template<typename T>
+static T* reserveMore(T* p, size_t used, size_t n, size_t* cap) {
+	if (used + n <= *cap) return p;
+	*cap = (*cap + n) * 2;
+	return (T*)realloc(p, *cap * sizeof(T));
+}
+
+// What a consumer that re-parses the OBJ does: reads it all and turns every
+// v, vt, vn and f line back into arrays. Returns the triangles found.
+static size_t parseOBJ(FILE* fp) {
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	rewind(fp);
+	char* text = (char*)malloc(size + 1);
+	size_t got = fread(text, 1, size, fp);
+	text[got] = 0;
+
+	f32* values = NULL; // v, vt and vn together; only the parse is being timed
+	u32* corners = NULL;
+	size_t numValues = 0, valueCap = 0, numCorners = 0, cornerCap = 0;
+	for (char* p = text; *p; ) {
+		char* end;
+		if (p[0] == 'v') {
+			p += (p[1] == ' ') ? 1 : 2;
+			values = reserveMore(values, numValues, 3, &valueCap);
+			for (int c = 0; c < 3; c++) {
+				f32 v = strtof(p, &end);
+				if (end == p) break;
+				values[numValues++] = v;
+				p = end;
+			}
+		} else if (p[0] == 'f' && p[1] == ' ') {
+			p++;
+			corners = reserveMore(corners, numCorners, 9, &cornerCap);
+			for (int c = 0; c < 9; c++) {
+				corners[numCorners++] = strtoul(p, &end, 10);
+				p = (*end == '/') ? end + 1 : end;
+			}
+		}
+		while (*p && *p != '\n') p++;
+		if (*p) p++;
+	}
+	free(values);
+	free(corners);
+	free(text);
+	return numCorners / 9;
+}
+
+static void benchLoad(bspdata* bsp, int iterations) {
+	Mesh mesh = Mesh::FromBSPData(bsp);
+	double ms;
+	FILE* obj = writeTimed(mesh, obj_options(), &ms);
+	char path[] = "/tmp/bsp2obj-bench-XXXXXX";
+	int fd = mkstemp(path);
+	FILE* fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	bool written = obj != NULL && fp != NULL && MeshFile::write(fp, mesh, "textures");
+	long meshBytes = fp != NULL ? ftell(fp) : 0;
+	if (fp != NULL) written = fclose(fp) == 0 && written;
+	if (!written) {
+		fprintf(stderr, "Couldn't write the OBJ and mesh file.\n");
+		if (obj != NULL) fclose(obj);
+		unlink(path);
+		return;
+	}
+
+	double parse = 0, mapped = 0, verified = 0, touched = 0;
+	size_t objTris = 0, meshTris = 0;
+	f32 sum = 0; // keeps the touching reads from being dropped
+	for (int i = 0; i < iterations; i++) {
+		double t0 = now_ms();
+		objTris = parseOBJ(obj);
+		double t1 = now_ms();
+		MeshFile quick, checked;
+		bool ok = quick.open(path, false);
+		double t2 = now_ms();
+		ok = checked.open(path) && ok;
+		double t3 = now_ms();
+		const f32* pos = quick.positions();
+		for (u32 k = 0; k < quick.indexCount(); k++) sum += pos[quick.index(k) * 3];
+		double t4 = now_ms();
+		if (!ok) {
+			unlink(path);
+			fclose(obj);
+			return;
+		}
+		meshTris = quick.indexCount() / 3;
+		if (i == 0 || t1 - t0 < parse) parse = t1 - t0;
+		if (i == 0 || t2 - t1 < mapped) mapped = t2 - t1;
+		if (i == 0 || t3 - t2 < verified) verified = t3 - t2;
+		if (i == 0 || (t2 - t1) + (t4 - t3) < touched) touched = (t2 - t1) + (t4 - t3);
+	}
+	unlink(path);
+	long objBytes = ftell(obj);
+	fclose(obj);
+
+	printf("load: %ld bytes of OBJ, %ld bytes of mesh file, %lu and %lu triangles (%g)\n", objBytes, meshBytes,
+		(unsigned long)objTris, (unsigned long)meshTris, sum);
+	printf("  best of %i: OBJ parse %.3f ms; mesh file map %.3f ms, map and verify %.3f ms,\n", iterations,
+		parse, mapped, verified);
+	printf("  map and read every indexed position %.3f ms (%.0fx faster than parsing)\n", touched,
+		touched > 0 ? parse / touched : 0.0);
+}
+
+static void usage() {
+	puts("usage: bsp2obj-bench <mode> infile.bsp [iterations]\n");
+	puts("modes:");
+	puts("  build    time Mesh::FromBSPData and count its operator new calls");
+	puts("  bvh      time BVH builds, then raycasts against the BVH read back from disk");
+	puts("  write    time writing the OBJ formatted on 1 thread and on all");
+	puts("  bake     time the vertex light and occlusion bake on 1 thread and on all");
+	puts("  query    time point contents and traces against hulls 0-2");
+	puts("  load     time parsing the OBJ back against mapping the mesh file");
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		usage();
+		return 1;
+	}
+
+	const char* mode = argv[1];
+	const char* infile = argv[2];
+	int iterations = (argc > 3) ? atoi(argv[3]) : 10;
+	if (iterations < 1) iterations = 1;
+
+	FILE *fp = fopen(infile, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Couldn't open %s for reading.\n", infile);
+		return 1;
+	}
+	bspdata bsp;
+	bool loaded = bsp.loadFromFilePointer(fp);
+	fclose(fp);
+	if (!loaded) return 1;
+
+	if (!strcmp(mode, "build")) {
+		benchBuild(&bsp, iterations);
+	} else if (!strcmp(mode, "bvh")) {
+		benchBVH(&bsp, iterations);
+	} else if (!strcmp(mode, "write")) {
+		benchWrite(&bsp, iterations);
+	} else if (!strcmp(mode, "bake")) {
+		benchBake(&bsp, iterations);
+	} else if (!strcmp(mode, "query")) {
+		benchQuery(&bsp, iterations);
+	} else if (!strcmp(mode, "load")) {
+		benchLoad(&bsp, iterations);
+	} else {
+		usage();
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef BOUNDEDQUEUE_H_INCLUDED
+#define BOUNDEDQUEUE_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking FIFO between pipeline stages. The capacity is what keeps a fast
+// producer from running arbitrarily far ahead of a slow consumer.
+template<typename T>
+class BoundedQueue {
+	std::mutex lock;
+	std::condition_variable notEmpty, notFull;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+public:
+	explicit BoundedQueue(size_t cap) : capacity(cap > 0 ? cap : 1) { }
+	BoundedQueue(const BoundedQueue& other) = delete;
+
+	// blocks while full; false if the queue was closed first
+	bool push(T item) {
+		std::unique_lock<std::mutex> guard(lock);
+		notFull.wait(guard, [this]() { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// blocks while empty; false once the queue is closed and drained
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> guard(lock);
+		notEmpty.wait(guard, [this]() { return closed || !items.empty(); });
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// no more pushes; consumers drain what's left
+	void close() {
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "bspcache.hpp"
+#include <stdio.h>
+#include <sys/stat.h>
+#include "pakfile.hpp"
+#include "pipeline.hpp"
+
+std::shared_ptr<bspdata> BSPCache::get(const char* path, bool* hit)
+{
+	if (hit != NULL) *hit = false;
+
+	// a map inside a pak is as fresh as the pak
+	std::string pak, pakentry;
+	const char* file = splitPakPath(path, &pak, &pakentry) ? pak.c_str() : path;
+
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		fprintf(stderr, "Couldn't open %s for reading.\n", file);
+		return std::shared_ptr<bspdata>();
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->path != path) continue;
+			if (it->mtime == (long long)st.st_mtime && it->size == (long long)st.st_size) {
+				entries.splice(entries.begin(), entries, it);
+				if (hit != NULL) *hit = true;
+				return entries.front().bsp;
+			}
+			entries.erase(it); // stale
+			break;
+		}
+	}
+
+	// load outside the lock; two requests racing for the same new map both
+	// load it and the later one wins the slot
+	auto bsp = std::make_shared<bspdata>();
+	if (!loadMap(path, bsp.get(), NULL, NULL, NULL)) return std::shared_ptr<bspdata>();
+
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto it = entries.begin(); it != entries.end(); ++it) {
+		if (it->path == path) {
+			entries.erase(it);
+			break;
+		}
+	}
+	entries.push_front(entry{path, (long long)st.st_mtime, (long long)st.st_size, bsp,
+		std::map<std::string, std::shared_future<bool>>()});
+	while (entries.size() > capacity) entries.pop_back();
+	return bsp;
+}
+
+bool BSPCache::extractTextures(const bspdata* bsp, const std::string& key, const std::function<bool()>& extract)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	auto e = entries.begin();
+	while (e != entries.end() && e->bsp.get() != bsp) ++e;
+	if (e == entries.end()) {
+		guard.unlock();
+		return extract(); // already evicted: nothing remembers it
+	}
+	auto found = e->textures.find(key);
+	if (found != e->textures.end()) {
+		std::shared_future<bool> pending = found->second;
+		guard.unlock();
+		return pending.get();
+	}
+	std::promise<bool> result;
+	e->textures[key] = result.get_future().share();
+	guard.unlock();
+
+	bool ok = extract();
+	if (!ok) {
+		guard.lock();
+		for (auto& other: entries) {
+			if (other.bsp.get() == bsp) other.textures.erase(key);
+		}
+		guard.unlock();
+	}
+	result.set_value(ok);
+	return ok;
+}
@@ -0,0 +1,40 @@
+#ifndef BSPCACHE_H_INCLUDED
+#define BSPCACHE_H_INCLUDED
+
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "bspdata.hpp"
+
+// Least-recently-used set of parsed maps, keyed by path and checked against
+// the file's size and modification time so an edited map is reloaded. Each
+// entry also remembers where its textures have been extracted to.
+class BSPCache {
+	struct entry {
+		std::string path;
+		long long mtime, size;
+		std::shared_ptr<bspdata> bsp;
+		std::map<std::string, std::shared_future<bool>> textures; // by key, done or under way
+	};
+	std::list<entry> entries; // most recently used first
+	size_t capacity;
+	std::mutex lock;
+public:
+	explicit BSPCache(size_t cap) : capacity(cap > 0 ? cap : 1) { }
+	BSPCache(const BSPCache& other) = delete;
+
+	// the cached map, or a fresh load; empty if the file can't be loaded.
+	// Maps are shared read-only, and outlive their eviction while in use.
+	std::shared_ptr<bspdata> get(const char* path, bool* hit = NULL);
+	// Runs extract unless this map's textures have already been extracted
+	// under key. A request for a key that's still being extracted waits for
+	// it and shares its result. A failed extraction isn't remembered, so the
+	// next request for the key tries again. Different keys run at once.
+	bool extractTextures(const bspdata* bsp, const std::string& key, const std::function<bool()>& extract);
+};
+
+#endif
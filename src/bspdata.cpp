@@ -1,109 +1,366 @@
 #include "bspdata.hpp"
 #include "indexedimage.hpp"
+#include "dds.hpp"
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
-void bspdata::loadFromFilePointer(FILE *fp) {
+// bytes taken by all MIPLEVELS levels of a w*h miptex
+static int mipChainSize(const int w, const int h) {
+	int size = 0;
+	for (int m = 0; m < MIPLEVELS; m++) size += (w >> m) * (h >> m);
+	return size;
+}
+
+void bspdata::read(size_t ofs, void* dest, size_t bytes) const {
+	// reads past the end of the map come back as zeros
+	size_t n = ofs < size ? size - ofs : 0;
+	if (n > bytes) n = bytes;
+	if (n > 0) memcpy(dest, base + ofs, n);
+	memset((unsigned char*)dest + n, 0, bytes - n);
+}
+
+// reads a whole lump into a fresh buffer
+void* bspdata::readLump(const lump_t& lump, size_t elemsize) const {
+	int count = lump.filelen > 0 ? lump.filelen / elemsize : 0;
+	void* data = calloc(count > 0 ? count : 1, elemsize);
+	if (lump.fileofs >= 0) read(lump.fileofs, data, elemsize * count);
+	return data;
+}
+
+template<typename T>
+static void copyBounds(float* mins, float* maxs, const T& src) {
+	for (int i = 0; i < 3; i++) {
+		mins[i] = src.mins[i];
+		maxs[i] = src.maxs[i];
+	}
+}
+
+static void widenFace(dface2_t* dest, const dface_t& src) {
+	dest->planenum = src.planenum;
+	dest->side = src.side;
+	dest->firstedge = src.firstedge;
+	dest->numedges = src.numedges;
+	dest->texinfo = src.texinfo;
+	memcpy(dest->styles, src.styles, sizeof(src.styles));
+	dest->lightofs = src.lightofs;
+}
+
+static void widenEdge(dedge2_t* dest, const dedge_t& src) {
+	dest->v[0] = src.v[0];
+	dest->v[1] = src.v[1];
+}
+
+static void widenFaceList(unsigned int* dest, const unsigned short& src) {
+	*dest = src;
+}
+
+template<typename T>
+static void widenLeaf(dleaf2_t* dest, const T& src) {
+	dest->contents = src.contents;
+	dest->visofs = src.visofs;
+	copyBounds(dest->mins, dest->maxs, src);
+	dest->firstmarksurface = src.firstmarksurface;
+	dest->nummarksurfaces = src.nummarksurfaces;
+	memcpy(dest->ambient_level, src.ambient_level, sizeof(src.ambient_level));
+}
+
+// children keep their sign: negative ones are leaves, or contents for clipnodes
+template<typename T>
+static void widenNode(dnode2_t* dest, const T& src) {
+	dest->planenum = src.planenum;
+	dest->children[0] = src.children[0];
+	dest->children[1] = src.children[1];
+	copyBounds(dest->mins, dest->maxs, src);
+	dest->firstface = src.firstface;
+	dest->numfaces = src.numfaces;
+}
+
+// Read unsigned, as BSP2-aware engines do, so maps with more than 32767
+// clipnodes keep their far nodes: only the values past 0xFFF0 are contents.
+static int widenClipChild(short child) {
+	unsigned short u = child;
+	return u <= 0xFFF0 ? (int)u : (int)u - 0x10000;
+}
+
+static void widenClipNode(dclipnode2_t* dest, const dclipnode_t& src) {
+	dest->planenum = src.planenum;
+	dest->children[0] = widenClipChild(src.children[0]);
+	dest->children[1] = widenClipChild(src.children[1]);
+}
+
+// Sets *count from the header and arranges for dest to be read on first use,
+// each on-disk S widened to a D. With D and S the same, the lump is used as
+// read. repair, if given, then fixes up the entries before anyone sees them.
+template<typename D, typename S>
+void bspdata::bindWidened(lazy_lump<D>& dest, const lump_t& lump, int* count, void (*widen)(D*, const S&),
+	int (bspdata::*repair)(D*, int), const char* what)
+{
+	const int n = *count = lump.filelen > 0 ? lump.filelen / sizeof(S) : 0;
+	dest.bind([this, lump, n, widen, repair, what]() {
+		S* raw = (S*)readLump(lump, sizeof(S));
+		D* data = (D*)raw;
+		if (widen != NULL) {
+			data = (D*)calloc(n > 0 ? n : 1, sizeof(D));
+			for (int i = 0; i < n; i++) widen(data + i, raw[i]);
+			free(raw);
+		}
+		int repaired = repair != NULL ? (this->*repair)(data, n) : 0;
+		if (repaired > 0) fprintf(stderr, "Repaired %i bad reference(s) in the map's %s.\n", repaired, what);
+		return data;
+	});
+}
 
+#define BUFFER_CHUNK (1 << 16) // first read of a stream; the buffer doubles from there
+
+// Pipes can't seek, and the loader visits lumps out of file order, so a
+// stream is read front to back once, in offset order, up to the end of the
+// last lump. Padding between lumps comes along so offsets stay valid. The
+// header's offsets aren't trusted with the allocation: the buffer grows
+// with what the stream actually holds, and a short one is left for the
+// lump checks to reject.
+static unsigned char* bufferLumps(FILE *fp, size_t* size) {
+	dheader_t hdr;
+	if (fread(&hdr, sizeof(dheader_t), 1, fp) != 1) {
+		fprintf(stderr, "Couldn't read the BSP header.\n");
+		return NULL;
+	}
+
+	size_t end = sizeof(dheader_t);
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		if (hdr.lumps[i].fileofs < 0 || hdr.lumps[i].filelen < 0) continue;
+		size_t lumpend = (size_t)hdr.lumps[i].fileofs + hdr.lumps[i].filelen;
+		if (lumpend > end) end = lumpend;
+	}
+
+	size_t cap = std::min(end, (size_t)BUFFER_CHUNK);
+	size_t len = sizeof(dheader_t);
+	unsigned char* data = (unsigned char*)malloc(cap);
+	if (data == NULL) {
+		fprintf(stderr, "Couldn't allocate %lu bytes for the BSP.\n", (unsigned long)cap);
+		return NULL;
+	}
+	memcpy(data, &hdr, sizeof(dheader_t));
+	for (;;) {
+		len += fread(data + len, 1, cap - len, fp);
+		if (len < cap || cap == end) break; // the stream or the lumps ran out
+
+		cap = end - cap > cap ? cap * 2 : end;
+		unsigned char* grown = (unsigned char*)realloc(data, cap);
+		if (grown == NULL) {
+			fprintf(stderr, "Couldn't allocate %lu bytes for the BSP.\n", (unsigned long)cap);
+			free(data);
+			return NULL;
+		}
+		data = grown;
+	}
+	*size = len;
+	return data;
+}
+
+// Maps a regular file so lumps come straight from the page cache; NULL for
+// anything that can't be mapped.
+static std::shared_ptr<const void> mapFile(FILE* fp, size_t* size) {
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return nullptr;
+	void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (mapped == MAP_FAILED) return nullptr;
+	*size = st.st_size;
+	size_t len = st.st_size;
+	return std::shared_ptr<const void>(mapped, [len](const void* p) { munmap((void*)p, len); });
+}
+
+bool bspdata::loadFromFilePointer(FILE *fp, bsp_loaded_fn texturesReady, void* ctx) {
+	size_t len = 0;
+	auto mapped = mapFile(fp, &len);
+	if (mapped) return loadFromMemory(mapped.get(), len, texturesReady, ctx, mapped);
+
+	// a pipe or something else unmappable: buffer what the lumps cover, from
+	// the start of the file if it seeks at all
 	auto pos = ftell(fp);
+	bool seekable = pos >= 0 && fseek(fp, 0, SEEK_SET) == 0;
+	unsigned char* data = bufferLumps(fp, &len);
+	if (seekable) fseek(fp, pos, SEEK_SET);
+	if (data == NULL) return false;
+	return loadFromMemory(data, len, texturesReady, ctx, std::shared_ptr<const void>(data, free));
+}
+
+bool bspdata::loadFromMemory(const void* data, size_t size, bsp_loaded_fn texturesReady, void* ctx,
+	std::shared_ptr<const void> keepalive)
+{
+	if (!keepalive) {
+		void* copy = malloc(size > 0 ? size : 1);
+		if (copy == NULL) {
+			fprintf(stderr, "Couldn't allocate %lu bytes for the BSP.\n", (unsigned long)size);
+			return false;
+		}
+		memcpy(copy, data, size);
+		keepalive = std::shared_ptr<const void>(copy, free);
+		data = copy;
+	}
+	backing = keepalive;
+	base = (const unsigned char*)data;
+	this->size = size;
+	return load(texturesReady, ctx);
+}
 
-	fseek(fp, 0, SEEK_SET);
-	fread(&(header), sizeof(dheader_t), 1, fp);
+bool bspdata::load(bsp_loaded_fn texturesReady, void* ctx) {
+
+	read(0, &header, sizeof(dheader_t));
+
+	switch (header.version) {
+		case BSPVERSION: format = BSPFormat::BSP29; break;
+		case BSP2VERSION_BSP2: format = BSPFormat::BSP2; break;
+		case BSP2VERSION_2PSB: format = BSPFormat::BSP2PSB; break;
+		default:
+			fprintf(stderr, "Unsupported BSP version %i.\n", header.version);
+			return false;
+	}
 
 	// dump_header(header);
 
-	// read entities data
-	entities_raw = (char*)calloc(header.lumps[LUMP_ENTITIES].filelen + 1, sizeof(char));
-	fseek(fp, header.lumps[LUMP_ENTITIES].fileofs, SEEK_SET);
-	fread(entities_raw, sizeof(char), header.lumps[LUMP_ENTITIES].filelen, fp);
-	entities_raw[header.lumps[LUMP_ENTITIES].filelen] = 0;
-
-	ent_parser = new EntityParser(entities_raw);
-
-	// load vertices
-	numVertices = header.lumps[LUMP_VERTEXES].filelen / sizeof(dvertex_t);
-	vertices = (dvertex_t*)calloc(numVertices, sizeof(dvertex_t));
-	fseek(fp, header.lumps[LUMP_VERTEXES].fileofs, SEEK_SET);
-	fread(vertices, sizeof(dvertex_t), numVertices, fp);
-
-	// load faces
-	numFaces = header.lumps[LUMP_FACES].filelen / sizeof(dface_t);
-	faces = (dface_t*)calloc(numFaces, sizeof(dface_t));
-	fseek(fp, header.lumps[LUMP_FACES].fileofs, SEEK_SET);
-	fread(faces, sizeof(dface_t), numFaces, fp);
-
-	// load face lists
-	numFaceLists = header.lumps[LUMP_MARKSURFACES].filelen / sizeof(unsigned short);
-	faceLists = (unsigned short*)calloc(numFaceLists, sizeof(unsigned short));
-	fseek(fp, header.lumps[LUMP_MARKSURFACES].fileofs, SEEK_SET);
-	fread(faceLists, sizeof(unsigned short), numFaceLists, fp);
-
-	// load planes
-	numPlanes = header.lumps[LUMP_PLANES].filelen / sizeof(dplane_t);
-	planes = (dplane_t*)calloc(numPlanes, sizeof(dplane_t));
-	fseek(fp, header.lumps[LUMP_PLANES].fileofs, SEEK_SET);
-	fread(planes, sizeof(dplane_t), numPlanes, fp);
-
-	// load edges
-	numEdges = header.lumps[LUMP_EDGES].filelen / sizeof(dedge_t);
-	edges = (dedge_t*)calloc(numEdges, sizeof(dedge_t));
-	fseek(fp, header.lumps[LUMP_EDGES].fileofs, SEEK_SET);
-	fread(edges, sizeof(dedge_t), numEdges, fp);
-
-	// load edge lists
-	numEdgeLists = header.lumps[LUMP_SURFEDGES].filelen / sizeof(int);
-	edgeLists = (int*)calloc(numEdgeLists, sizeof(int));
-	fseek(fp, header.lumps[LUMP_SURFEDGES].fileofs, SEEK_SET);
-	fread(edgeLists, sizeof(int), numEdgeLists, fp);
-
-	// load texinfos
-	numTexInfos = header.lumps[LUMP_TEXINFO].filelen / sizeof(texinfo_t);
-	texInfos = (texinfo_t*)calloc(numTexInfos, sizeof(texinfo_t));
-	fseek(fp, header.lumps[LUMP_TEXINFO].fileofs, SEEK_SET);
-	fread(texInfos, sizeof(texinfo_t), numTexInfos, fp);
-
-	// load lightmaps
-	numLightMaps = header.lumps[LUMP_LIGHTING].filelen; // byte size
-	lightMaps = (byte*)calloc(numLightMaps, sizeof(byte));
-	fseek(fp, header.lumps[LUMP_LIGHTING].fileofs, SEEK_SET);
-	fread(lightMaps, sizeof(byte), numLightMaps, fp);
-
-	// load BSP leaves
-	numLeaves = header.lumps[LUMP_LEAFS].filelen / sizeof(dleaf_t);
-	leaves = (dleaf_t*)calloc(numLeaves, sizeof(dleaf_t));
-	fseek(fp, header.lumps[LUMP_LEAFS].fileofs, SEEK_SET);
-	fread(leaves, sizeof(dleaf_t), numLeaves, fp);
-
-	// load models
-	numModels = header.lumps[LUMP_MODELS].filelen / sizeof(dmodel_t);
-	models = (dmodel_t*)calloc(numModels, sizeof(dmodel_t));
-	fseek(fp, header.lumps[LUMP_MODELS].fileofs, SEEK_SET);
-	fread(models, sizeof(dmodel_t), numModels, fp);
-
-	// read miptexListLen
-	fseek(fp, header.lumps[LUMP_TEXTURES].fileofs, SEEK_SET);
-	fread(&miptexListLen, sizeof(int), 1, fp);
+	if (!checkLumps()) return false;
+	int repaired = 0;
+
+	// read miptexListLen; textures come first so their extraction can
+	// overlap the rest of the load
+	const lump_t& texlump = header.lumps[LUMP_TEXTURES];
+	miptexListLen = 0;
+	if (texlump.filelen >= (int)sizeof(int)) read(texlump.fileofs, &miptexListLen, sizeof(int));
+	if (miptexListLen < 0 || (size_t)miptexListLen > (texlump.filelen - sizeof(int)) / sizeof(int)) {
+		fprintf(stderr, "The texture directory runs past the end of its lump.\n");
+		miptexListLen = 0;
+		return false;
+	}
 
 	// read miptexListLen * int offset
-	int texOffsets[miptexListLen];
-	fseek(fp, header.lumps[LUMP_TEXTURES].fileofs + sizeof(int), SEEK_SET);
-	fread(texOffsets, sizeof(int), miptexListLen, fp);
+	std::vector<int> texOffsets(miptexListLen);
+	read(texlump.fileofs + sizeof(int), texOffsets.data(), sizeof(int) * miptexListLen);
 
-	miptexList = (miptex_t*)calloc(miptexListLen, sizeof(miptex_t));
-	miptexData = (unsigned char**)calloc(miptexListLen, sizeof(unsigned char*));
+	// only the headers are read now; each texture's pixels wait until
+	// something asks for them. A texture outside the lump (-1 marks a
+	// missing one) is left blank for repairMiptex to fill in.
+	miptexList = (miptex_t*)calloc(miptexListLen > 0 ? miptexListLen : 1, sizeof(miptex_t));
+	miptexData.reset(new lazy_lump<unsigned char>[miptexListLen]);
 	for (int i = 0; i < miptexListLen; i++) {
-		fseek(fp, header.lumps[LUMP_TEXTURES].fileofs + texOffsets[i], SEEK_SET);
-		fread(miptexList + i, sizeof(miptex_t), 1, fp);
-		miptexData[i] = (unsigned char*)calloc(miptexList[i].width * miptexList[i].height, sizeof(unsigned char));
-		fseek(fp, header.lumps[LUMP_TEXTURES].fileofs + texOffsets[i] + 40, SEEK_SET);
-		fread(miptexData[i], sizeof(unsigned char), miptexList[i].width * miptexList[i].height, fp);
+		size_t avail = 0;
+		if (texOffsets[i] >= 0 && (size_t)texOffsets[i] + sizeof(miptex_t) <= (size_t)texlump.filelen) {
+			avail = texlump.filelen - texOffsets[i];
+			read(texlump.fileofs + texOffsets[i], miptexList + i, sizeof(miptex_t));
+		}
+		repaired += repairMiptex(i, avail);
+		size_t texofs = texlump.fileofs + (avail > 0 ? texOffsets[i] : 0);
+
+		// keep every stored mip level, not just the first
+		const miptex_t* mt = miptexList + i;
+		miptexData[i].bind([this, mt, texofs]() {
+			int w = mt->width, h = mt->height;
+			int total = mipChainSize(w, h);
+			unsigned char* pixels = (unsigned char*)calloc(total > 0 ? total : 1, sizeof(unsigned char));
+			unsigned char* level = pixels;
+			for (int m = 0; m < MIPLEVELS; m++) {
+				int size = (w >> m) * (h >> m);
+				if (mt->offsets[m] != 0) read(texofs + mt->offsets[m], level, size);
+				level += size;
+			}
+			return pixels;
+		});
 	}
+	if (repaired > 0) fprintf(stderr, "Repaired %i bad reference(s) in the map's textures.\n", repaired);
+
+	if (texturesReady != NULL) texturesReady(this, ctx);
+
+	bindWidened<dvertex_t, dvertex_t>(vertices, header.lumps[LUMP_VERTEXES], &numVertices, NULL);
+
+	// faces, edges and face lists: BSP29 stores these with 16-bit fields, so
+	// they're widened; the large-map formats are used as read
+	if (format == BSPFormat::BSP29) {
+		bindWidened(faces, header.lumps[LUMP_FACES], &numFaces, widenFace, &bspdata::repairFaces, "faces");
+		bindWidened(edges, header.lumps[LUMP_EDGES], &numEdges, widenEdge, &bspdata::repairEdges, "edges");
+		bindWidened(faceLists, header.lumps[LUMP_MARKSURFACES], &numFaceLists, widenFaceList,
+			&bspdata::repairFaceLists, "marksurfaces");
+	} else {
+		bindWidened<dface2_t, dface2_t>(faces, header.lumps[LUMP_FACES], &numFaces, NULL,
+			&bspdata::repairFaces, "faces");
+		bindWidened<dedge2_t, dedge2_t>(edges, header.lumps[LUMP_EDGES], &numEdges, NULL,
+			&bspdata::repairEdges, "edges");
+		bindWidened<unsigned int, unsigned int>(faceLists, header.lumps[LUMP_MARKSURFACES], &numFaceLists, NULL,
+			&bspdata::repairFaceLists, "marksurfaces");
+	}
+
+	bindWidened<dplane_t, dplane_t>(planes, header.lumps[LUMP_PLANES], &numPlanes, NULL);
+	bindWidened<int, int>(edgeLists, header.lumps[LUMP_SURFEDGES], &numEdgeLists, NULL,
+		&bspdata::repairEdgeLists, "surface edges");
+	bindWidened<texinfo_t, texinfo_t>(texInfos, header.lumps[LUMP_TEXINFO], &numTexInfos, NULL,
+		&bspdata::repairTexInfos, "texture infos");
+	bindWidened<byte, byte>(lightMaps, header.lumps[LUMP_LIGHTING], &numLightMaps, NULL); // byte size
+
+	// BSP leaves, widening the short-bounded layouts
+	if (format == BSPFormat::BSP2) {
+		bindWidened<dleaf2_t, dleaf2_t>(leaves, header.lumps[LUMP_LEAFS], &numLeaves, NULL,
+			&bspdata::repairLeaves, "leaves");
+	} else if (format == BSPFormat::BSP2PSB) {
+		bindWidened(leaves, header.lumps[LUMP_LEAFS], &numLeaves, widenLeaf<dleaf2psb_t>,
+			&bspdata::repairLeaves, "leaves");
+	} else {
+		bindWidened(leaves, header.lumps[LUMP_LEAFS], &numLeaves, widenLeaf<dleaf_t>,
+			&bspdata::repairLeaves, "leaves");
+	}
+
+	bindWidened<dmodel_t, dmodel_t>(models, header.lumps[LUMP_MODELS], &numModels, NULL,
+		&bspdata::repairModels, "models");
+
+	// nodes and clipnodes, for the queries in bsptrace.cpp
+	if (format == BSPFormat::BSP2) {
+		bindWidened<dnode2_t, dnode2_t>(nodes, header.lumps[LUMP_NODES], &numNodes, NULL,
+			&bspdata::repairNodes, "nodes");
+	} else if (format == BSPFormat::BSP2PSB) {
+		bindWidened(nodes, header.lumps[LUMP_NODES], &numNodes, widenNode<dnode2psb_t>,
+			&bspdata::repairNodes, "nodes");
+	} else {
+		bindWidened(nodes, header.lumps[LUMP_NODES], &numNodes, widenNode<dnode_t>,
+			&bspdata::repairNodes, "nodes");
+	}
+	if (format == BSPFormat::BSP29) {
+		bindWidened(clipNodes, header.lumps[LUMP_CLIPNODES], &numClipNodes, widenClipNode,
+			&bspdata::repairClipNodes, "clipnodes");
+	} else {
+		bindWidened<dclipnode2_t, dclipnode2_t>(clipNodes, header.lumps[LUMP_CLIPNODES], &numClipNodes, NULL,
+			&bspdata::repairClipNodes, "clipnodes");
+	}
+	hull0.bind([this]() { return makeHull0(); });
+
+	return true;
+}
+
+const std::vector<quake_entity_t>& bspdata::getEntities() const {
+	std::call_once(entitiesOnce, [this]() {
+		const lump_t& lump = header.lumps[LUMP_ENTITIES];
+		int len = lump.filelen > 0 ? lump.filelen : 0;
+		char* raw = (char*)calloc(len + 1, sizeof(char));
+		if (lump.fileofs >= 0) read(lump.fileofs, raw, len);
+		ent_parser.reset(new EntityParser(raw));
+		free(raw);
+	});
+	return ent_parser->entities;
+}
 
-	// reset file pointer to where it was
-	fseek(fp, pos, SEEK_SET);
+const char* bspdata::formatName() const {
+	switch (format) {
+		case BSPFormat::BSP29: return "BSP29";
+		case BSPFormat::BSP2: return "BSP2";
+		case BSPFormat::BSP2PSB: return "2PSB";
+		default: return "unknown";
+	}
 }
 
 std::vector<dvertex_t> bspdata::getFaceVertices(int faceid) const {
 	std::vector<dvertex_t> verts;
-	dface_t *face = faces + faceid;
+	dface2_t *face = faces + faceid;
 	for (int i = 0; i < face->numedges; i++) {
 		auto e = edgeLists[face->firstedge + i];
 		dvertex_t *v;
@@ -117,6 +374,52 @@ std::vector<dvertex_t> bspdata::getFaceVertices(int faceid) const {
 	return verts;
 }
 
+int bspdata::getFaceVertexIndices(int faceid, int* scratch, int maxverts) const {
+	const dface2_t *face = faces + faceid;
+	if (face->numedges > maxverts) return -1;
+	const int *ledges = edgeLists + face->firstedge;
+	const dedge2_t *e2 = edges;
+	for (int i = 0; i < face->numedges; i++) {
+		int e = ledges[i];
+		scratch[i] = (e >= 0) ? e2[e].v[0] : e2[-e].v[1];
+	}
+	return face->numedges;
+}
+
+int bspdata::getMaxFaceVertices() const {
+	int most = 0;
+	const dface2_t *f = faces;
+	for (int i = 0; i < numFaces; i++) {
+		if (f[i].numedges > most) most = f[i].numedges;
+	}
+	return most;
+}
+
+static const char* surfaceClassNames[] = {
+	"solid",
+	"sky",
+	"liquid",
+	"clip",
+	"trigger",
+	"special",
+};
+
+const char* surfaceClassName(SurfaceClass c) {
+	return surfaceClassNames[(int)c];
+}
+
+SurfaceClass bspdata::getSurfaceClass(int texinfo) const {
+	// the texinfo lump's repair checked every miptex when it was read
+	const texinfo_t& tinfo = texInfos[texinfo];
+	const char* name = miptexList[tinfo.miptex].name;
+	if (!strncasecmp(name, "sky", 3)) return SurfaceClass::Sky;
+	if (name[0] == '*') return SurfaceClass::Liquid;
+	if (!strncasecmp(name, "clip", 4)) return SurfaceClass::Clip;
+	if (!strncasecmp(name, "trigger", 7)) return SurfaceClass::Trigger;
+	if (tinfo.flags & TEX_SPECIAL) return SurfaceClass::Special;
+	return SurfaceClass::Solid;
+}
+
 static std::string replaceChar(const std::string str, const char* subj, const char* repl) {
 	std::string modified = str;
 	std::string::size_type loc = modified.find(subj);
@@ -127,44 +430,106 @@ static std::string replaceChar(const std::string str, const char* subj, const ch
 	return modified;
 }
 
-static void extractTexture(const char* path, const char* name, const int w, const int h, const unsigned char* data)
+const unsigned char* bspdata::getMipLevel(int miptex, int level, int* w, int* h) const
+{
+	const unsigned char* data = miptexData[miptex].get();
+	int tw = miptexList[miptex].width, th = miptexList[miptex].height;
+	for (int m = 0; m < level; m++) data += (tw >> m) * (th >> m);
+	*w = tw >> level;
+	*h = th >> level;
+	return data;
+}
+
+static bool extractTexture(OutputSink* sink, const char* path, const char* name, const int w, const int h, const unsigned char* data)
 {
 	char outname[125] = {0};
 	snprintf(outname, 125, "%s/%s.tga", path, name);
 	std::string fixedname(outname);
 	fixedname = replaceChar(fixedname, "*", "_");
 
+	FILE* fp = sink->open(fixedname);
+	if (fp == NULL) return false;
 	ImageBuffer buf(w, h, data);
-	buf.write(fixedname);
+	bool ok = buf.write(fp);
+	ok = sink->close(fp) && ok;
+	if (!ok) fprintf(stderr, "Couldn't write file: %s\n", fixedname.c_str());
+	return ok;
 }
 
-void bspdata::extractTextures(const char* dirname) const
+// the four stored levels are expanded as-is; only the levels below them are
+// generated, so the result can be uploaded without building mips at runtime
+static bool extractTextureDDS(OutputSink* sink, const char* path, const bspdata* bsp, int miptex, const bc_options* bc)
 {
-	for (int i = 0; i < miptexListLen; i++) {
-		int w = miptexList[i].width;
-		int h = miptexList[i].height;
-		extractTexture(dirname, miptexList[i].name, w, h, miptexData[i]);
+	char outname[125] = {0};
+	snprintf(outname, 125, "%s/%s.dds", path, bsp->miptexList[miptex].name);
+	std::string fixedname(outname);
+	fixedname = replaceChar(fixedname, "*", "_");
+
+	// only the compressed path keys '{' textures, since it has a format to spend on it
+	bool keyed = bc != NULL && bsp->miptexList[miptex].name[0] == '{';
+
+	std::vector<mip_level> levels;
+	for (int m = 0; m < MIPLEVELS; m++) {
+		mip_level level;
+		const unsigned char* data = bsp->getMipLevel(miptex, m, &level.w, &level.h);
+		if (level.w < 1 || level.h < 1) break;
+		level.rgba.resize(level.w * level.h * 4);
+		expandPalette(data, level.w * level.h, level.rgba.data(), keyed);
+		levels.push_back(std::move(level));
 	}
+	extendMipChain(levels);
+
+	FILE* fp = sink->open(fixedname);
+	if (fp == NULL) return false;
+	bool ok;
+	if (bc == NULL) {
+		ok = writeDDS(fp, levels);
+	} else {
+		ok = writeDDS(fp, levels, keyed ? bc->keyed : bc->opaque, bc->quality);
+	}
+	ok = sink->close(fp) && ok;
+	if (!ok) fprintf(stderr, "Couldn't write file: %s\n", fixedname.c_str());
+	return ok;
 }
 
-bspdata::~bspdata() {
-	if (entities_raw != NULL) free(entities_raw);
-	if (miptexList != nullptr) free(miptexList);
-	if (vertices != NULL) free(vertices);
-	if (faces != NULL) free(faces);
-	if (faceLists != NULL) free(faceLists);
-	if (planes != NULL) free(planes);
-	if (edgeLists != NULL) free(edgeLists);
-	if (edges != NULL) free(edges);
-	if (texInfos != NULL) free(texInfos);
-	if (lightMaps != NULL) free(lightMaps);
-	if (leaves != NULL) free(leaves);
-	if (models != NULL) free(models);
-	if (miptexData != NULL) {
-		for (int i = 0; i < miptexListLen; i++) {
-			if (miptexData[i] != NULL) free(miptexData[i]);
+bool bspdata::extractTextures(const char* dirname, TextureFormat fmt, const bc_options* bc, OutputSink* sink) const
+{
+	DirectorySink files;
+	if (sink == NULL) sink = &files;
+
+	if (fmt == TextureFormat::DDS && bc != NULL) {
+		// textures are independent, so workers just pull the next one
+		int nthreads = bc->threads > 0 ? bc->threads : (int)std::thread::hardware_concurrency();
+		if (nthreads < 1) nthreads = 1;
+		if (nthreads > miptexListLen) nthreads = miptexListLen;
+
+		std::atomic<int> next(0);
+		std::atomic<bool> ok(true);
+		auto worker = [&]() {
+			for (int i = next++; i < miptexListLen; i = next++) {
+				if (!extractTextureDDS(sink, dirname, this, i, bc)) ok = false;
+			}
+		};
+		std::vector<std::thread> workers;
+		for (int t = 1; t < nthreads; t++) workers.emplace_back(worker);
+		worker();
+		for (auto& t : workers) t.join();
+		return ok;
+	}
+
+	bool ok = true;
+	for (int i = 0; i < miptexListLen; i++) {
+		if (fmt == TextureFormat::DDS) {
+			ok = extractTextureDDS(sink, dirname, this, i, NULL) && ok;
+			continue;
 		}
-		free(miptexData);
+		int w, h;
+		const unsigned char* data = getMipLevel(i, 0, &w, &h);
+		ok = extractTexture(sink, dirname, miptexList[i].name, w, h, data) && ok;
 	}
+	return ok;
 }
 
+bspdata::~bspdata() {
+	if (miptexList != nullptr) free(miptexList);
+}
@@ -2,61 +2,218 @@
 #define BSPDATA_H_INCLUDED
 
 #include <stdlib.h>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include "qbsp.h"
 #include "common.h"
 #include "entityparser.hpp"
+#include "indexedimage.hpp"
+#include "bcenc.hpp"
+#include "outputsink.hpp"
 
 struct surfacemeta_t {
 	float texturemins[2];
 	float extents[2];
 };
 
+enum class BSPFormat {
+	Unknown,
+	BSP29,
+	BSP2,
+	BSP2PSB
+};
+
+// What a face is, as far as deciding whether to keep it goes: liquids are
+// the '*' textures, and special covers any other TEX_SPECIAL surface.
+enum class SurfaceClass {
+	Solid,
+	Sky,
+	Liquid,
+	Clip,
+	Trigger,
+	Special,
+	Count
+};
+
+const char* surfaceClassName(SurfaceClass c);
+
+// Result of a hull trace, as the game's trace_t has it.
+struct bsp_trace {
+	bool allsolid; // never left solid
+	bool startsolid; // began in solid
+	bool inopen, inwater; // passed through empty or liquid space
+	f32 fraction; // of the way from start to end before the hit, 1 for none
+	f32 endpos[3];
+	f32 normal[3]; // of the plane hit, facing the start
+	f32 dist;
+};
+
+class bspdata;
+typedef void (*bsp_loaded_fn)(const bspdata* bsp, void* ctx);
+
+// A lump that's only copied out of the map the first time something uses
+// it. It converts to a plain pointer, so callers index it like one; the
+// first use from any thread does the read and the others wait on it.
+template<typename T>
+class lazy_lump {
+	mutable std::once_flag once;
+	mutable T* data = NULL;
+	std::function<T*()> fill;
+public:
+	lazy_lump() { }
+	lazy_lump(const lazy_lump& other) = delete;
+	~lazy_lump() { free(data); }
+
+	void bind(const std::function<T*()>& fn) { fill = fn; }
+	T* get() const {
+		std::call_once(once, [this]() { if (fill) data = fill(); });
+		return data;
+	}
+	operator T*() const { return get(); }
+};
+
+// Lumps whose layout differs between formats are widened on load to the
+// BSP2 structures, so everything past the loader sees 32-bit indices no
+// matter which variant the map was compiled as.
+//
+// Loading only reads the header and the miptex headers. The map itself stays
+// mapped (or buffered) and each lump is read the first time it's used, so a
+// run that never looks at lighting, leaves or texture pixels never pays for
+// them. The counts are known from the header up front.
 class bspdata {
 public:
 	dheader_t header;
+	BSPFormat format = BSPFormat::Unknown;
+
+	int numVertices = 0;
+	lazy_lump<dvertex_t> vertices;
 
-	char* entities_raw;
-	EntityParser *ent_parser;
+	int numFaces = 0;
+	lazy_lump<dface2_t> faces;
 
-	int numVertices;
-	dvertex_t *vertices;
+	int numFaceLists = 0;
+	lazy_lump<unsigned int> faceLists;
 
-	int numFaces;
-	dface_t *faces;
+	int numPlanes = 0;
+	lazy_lump<dplane_t> planes;
 
-	int numFaceLists;
-	unsigned short *faceLists;
+	int numEdgeLists = 0;
+	lazy_lump<int> edgeLists;
 
-	int numPlanes;
-	dplane_t *planes;
+	int numEdges = 0;
+	lazy_lump<dedge2_t> edges;
 
-	int numEdgeLists;
-	int *edgeLists;
+	int numTexInfos = 0;
+	lazy_lump<texinfo_t> texInfos;
 
-	int numEdges;
-	dedge_t *edges;
+	int numLightMaps = 0;
+	lazy_lump<byte> lightMaps;
 
-	int numTexInfos;
-	texinfo_t *texInfos;
+	int numLeaves = 0;
+	lazy_lump<dleaf2_t> leaves;
 
-	int numLightMaps;
-	byte *lightMaps;
+	int miptexListLen = 0;
+	miptex_t* miptexList = NULL;
 
-	int numLeaves;
-	dleaf_t *leaves;
+	int numModels = 0;
+	lazy_lump<dmodel_t> models;
 
-	int miptexListLen;
-	miptex_t* miptexList;
-	unsigned char** miptexData;
+	int numNodes = 0;
+	lazy_lump<dnode2_t> nodes;
 
-	int numModels;
-	dmodel_t* models;
+	int numClipNodes = 0;
+	lazy_lump<dclipnode2_t> clipNodes;
 
+	bspdata() { }
+	bspdata(const bspdata& other) = delete;
 	~bspdata();
-	void loadFromFilePointer(FILE *fp);
+	// texturesReady, if set, is called from inside the load as soon as the
+	// miptex headers are in; the textures won't change after that.
+	bool loadFromFilePointer(FILE *fp, bsp_loaded_fn texturesReady = NULL, void* ctx = NULL);
+	// Same, from a complete BSP file in memory. Lumps are read from data
+	// later, so it's copied unless keepalive holds whatever owns it.
+	bool loadFromMemory(const void* data, size_t size, bsp_loaded_fn texturesReady = NULL, void* ctx = NULL,
+		std::shared_ptr<const void> keepalive = nullptr);
+	const char* formatName() const;
+	const std::vector<quake_entity_t>& getEntities() const;
+
+	// Spatial queries against a model's hulls (bsptrace.cpp). Coordinates are
+	// the model's own; hull 0 is points and lines, hulls 1 and 2 are the
+	// player- and shambler-sized boxes the compiler expanded the brushes by.
+	// Hull 0 walks the nodes, the others the clipnodes.
+	int pointLeaf(const f32 p[3], int model = 0) const; // -1 if there's no tree
+	// a CONTENTS_ value, or 0 for a hull or model that doesn't exist
+	int pointContents(const f32 p[3], int hull = 0, int model = 0) const;
+	// false for a hull or model that doesn't exist
+	bool trace(const f32 start[3], const f32 end[3], int hull, bsp_trace* tr, int model = 0) const;
+	// sweeps a box between mins and maxs (relative to start and end) through
+	// the hull that fits it, the way the game does
+	bool traceBox(const f32 start[3], const f32 end[3], const f32 mins[3], const f32 maxs[3], bsp_trace* tr,
+		int model = 0) const;
+	// batches share one hull and model and are split across threads
+	// (0 for one per core); out has count entries
+	void pointContentsBatch(const f32* points, int count, int hull, int* out, int model = 0, int threads = 0) const;
+	void traceBatch(const f32* starts, const f32* ends, int count, int hull, bsp_trace* out, int model = 0,
+		int threads = 0) const;
 	std::vector<dvertex_t> getFaceVertices(int faceid) const;
-	void extractTextures(const char* dirname) const;
+	// Non-allocating face walk: writes the face's vertex indices into the
+	// caller's scratch (room for maxverts) and returns the count, or -1 if it
+	// doesn't fit. Size scratch with getMaxFaceVertices().
+	int getFaceVertexIndices(int faceid, int* scratch, int maxverts) const;
+	int getMaxFaceVertices() const;
+	// by the texture's name first, then its TEX_SPECIAL flag
+	SurfaceClass getSurfaceClass(int texinfo) const;
+	const unsigned char* getMipLevel(int miptex, int level, int* w, int* h) const;
+	// With bc set, DDS output is block-compressed, spread across bc->threads.
+	// Files go to sink, or plain files when it's NULL. False if any of them
+	// couldn't be written.
+	bool extractTextures(const char* dirname, TextureFormat fmt = TextureFormat::TGA,
+		const bc_options* bc = NULL, OutputSink* sink = NULL) const;
+private:
+	std::shared_ptr<const void> backing; // owns base
+	const unsigned char* base = NULL;
+	size_t size = 0;
+
+	// hull 0 as clipnodes: node children, with leaves replaced by their
+	// contents, so every hull is walked the same way
+	lazy_lump<dclipnode2_t> hull0;
+	dclipnode2_t* makeHull0() const;
+	bool hullFor(int hull, int model, const dclipnode2_t** clip, int* count, int* head) const;
+	bool hullCheck(const dclipnode2_t* clip, int count, int head, int num, f32 p1f, f32 p2f,
+		const f32 p1[3], const f32 p2[3], bsp_trace* tr, int depth, int* visits) const;
+	int hullContents(const dclipnode2_t* clip, int count, int num, const f32 p[3]) const;
+
+	mutable std::once_flag entitiesOnce;
+	mutable std::unique_ptr<EntityParser> ent_parser;
+	// all MIPLEVELS levels back to back, level 0 first
+	std::unique_ptr<lazy_lump<unsigned char>[]> miptexData;
+
+	bool load(bsp_loaded_fn texturesReady, void* ctx);
+
+	// Validation (bspvalidate.cpp), so the mesh builder can follow indices
+	// unchecked. Lumps outside the file reject the map at load; bad entries
+	// are repaired as each lump is first read, checked against the other
+	// lumps' counts, and the repair functions return how many they fixed.
+	bool checkLumps() const;
+	// avail is how much of the texture lump the miptex at that offset may use
+	int repairMiptex(int i, size_t avail);
+	int repairEdges(dedge2_t* e, int n);
+	int repairEdgeLists(int* ledges, int n);
+	int repairTexInfos(texinfo_t* ti, int n);
+	int repairFaces(dface2_t* f, int n);
+	int repairModels(dmodel_t* m, int n);
+	int repairNodes(dnode2_t* nd, int n);
+	int repairClipNodes(dclipnode2_t* c, int n);
+	int repairLeaves(dleaf2_t* l, int n);
+	int repairFaceLists(unsigned int* marks, int n);
+	std::vector<bool> badTexInfos; // filled by repairTexInfos
+	void read(size_t ofs, void* dest, size_t bytes) const;
+	void* readLump(const lump_t& lump, size_t elemsize) const;
+	template<typename D, typename S>
+	void bindWidened(lazy_lump<D>& dest, const lump_t& lump, int* count, void (*widen)(D*, const S&),
+		int (bspdata::*repair)(D*, int) = NULL, const char* what = NULL);
 };
 
 #endif
@@ -0,0 +1,237 @@
+#include "bspdata.hpp"
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+// how far short of a plane a trace stops, so it never ends up inside it
+#define DIST_EPSILON 0.03125f
+// deeper than any compiled tree; past it a trace reads as solid, which keeps
+// hullCheck's recursion off the end of the stack
+#define MAX_HULL_DEPTH 1024
+
+// box each clipping hull was expanded by, hull 0 being a point
+static const f32 hullMins[3][3] = {
+	{ 0, 0, 0 },
+	{ -16, -16, -24 },
+	{ -32, -32, -24 },
+};
+
+dclipnode2_t* bspdata::makeHull0() const
+{
+	const dnode2_t* n = nodes;
+	const dleaf2_t* l = leaves;
+	dclipnode2_t* clip = (dclipnode2_t*)calloc(numNodes > 0 ? numNodes : 1, sizeof(dclipnode2_t));
+	for (int i = 0; i < numNodes; i++) {
+		clip[i].planenum = n[i].planenum;
+		for (int side = 0; side < 2; side++) {
+			int child = n[i].children[side];
+			if (child >= 0) {
+				clip[i].children[side] = child;
+			} else {
+				int leaf = -1 - child;
+				clip[i].children[side] = leaf < numLeaves ? l[leaf].contents : CONTENTS_SOLID;
+			}
+		}
+	}
+	return clip;
+}
+
+bool bspdata::hullFor(int hull, int model, const dclipnode2_t** clip, int* count, int* head) const
+{
+	if (hull < 0 || hull > 2 || model < 0 || model >= numModels) return false;
+	*head = models[model].headnode[hull];
+	if (hull == 0) {
+		*clip = hull0;
+		*count = numNodes;
+	} else {
+		*clip = clipNodes;
+		*count = numClipNodes;
+	}
+	return *count > 0 && *head >= 0 && *head < *count;
+}
+
+// broken child and plane references, and cycles, read as solid rather
+// than as memory or a hang
+int bspdata::hullContents(const dclipnode2_t* clip, int count, int num, const f32 p[3]) const
+{
+	const dplane_t* pl = planes;
+	for (int steps = 0; num >= 0; steps++) {
+		if (num >= count || steps > count || clip[num].planenum < 0 || clip[num].planenum >= numPlanes) {
+			return CONTENTS_SOLID;
+		}
+		const dplane_t& plane = pl[clip[num].planenum];
+		f32 d = (plane.type < 3) ? p[plane.type] - plane.dist
+			: plane.normal[0] * p[0] + plane.normal[1] * p[1] + plane.normal[2] * p[2] - plane.dist;
+		num = clip[num].children[d < 0 ? 1 : 0];
+	}
+	return num;
+}
+
+int bspdata::pointLeaf(const f32 p[3], int model) const
+{
+	if (model < 0 || model >= numModels || numNodes == 0) return -1;
+	const dnode2_t* n = nodes;
+	const dplane_t* pl = planes;
+	int num = models[model].headnode[0];
+	for (int steps = 0; num >= 0; steps++) {
+		if (num >= numNodes || steps > numNodes || n[num].planenum < 0 || n[num].planenum >= numPlanes) return -1;
+		const dplane_t& plane = pl[n[num].planenum];
+		f32 d = (plane.type < 3) ? p[plane.type] - plane.dist
+			: plane.normal[0] * p[0] + plane.normal[1] * p[1] + plane.normal[2] * p[2] - plane.dist;
+		num = n[num].children[d < 0 ? 1 : 0];
+	}
+	int leaf = -1 - num;
+	return leaf < numLeaves ? leaf : -1;
+}
+
+int bspdata::pointContents(const f32 p[3], int hull, int model) const
+{
+	const dclipnode2_t* clip;
+	int count, head;
+	if (!hullFor(hull, model, &clip, &count, &head)) return 0;
+	return hullContents(clip, count, head, p);
+}
+
+// Splits the segment p1-p2 at each plane it crosses, front part first; the
+// first solid space found past an empty one is the hit. False once it's hit.
+// In a tree each node gets at most one piece of the segment, so a trace
+// that visits more nodes than there are is walking a cycle or a shared
+// subtree, whose cost can double at every level; it reads as solid.
+bool bspdata::hullCheck(const dclipnode2_t* clip, int count, int head, int num, f32 p1f, f32 p2f,
+	const f32 p1[3], const f32 p2[3], bsp_trace* tr, int depth, int* visits) const
+{
+	if (num < 0) {
+		if (num != CONTENTS_SOLID) {
+			tr->allsolid = false;
+			if (num == CONTENTS_EMPTY) tr->inopen = true;
+			else tr->inwater = true;
+		} else {
+			tr->startsolid = true;
+		}
+		return true;
+	}
+	if (num >= count || ++*visits > count || depth > MAX_HULL_DEPTH
+		|| clip[num].planenum < 0 || clip[num].planenum >= numPlanes) {
+		tr->startsolid = true; // broken references and cycles read as solid
+		return true;
+	}
+
+	const dclipnode2_t& node = clip[num];
+	const dplane_t& plane = ((const dplane_t*)planes)[node.planenum];
+	f32 t1, t2;
+	if (plane.type < 3) {
+		t1 = p1[plane.type] - plane.dist;
+		t2 = p2[plane.type] - plane.dist;
+	} else {
+		t1 = plane.normal[0] * p1[0] + plane.normal[1] * p1[1] + plane.normal[2] * p1[2] - plane.dist;
+		t2 = plane.normal[0] * p2[0] + plane.normal[1] * p2[1] + plane.normal[2] * p2[2] - plane.dist;
+	}
+
+	if (t1 >= 0 && t2 >= 0) return hullCheck(clip, count, head, node.children[0], p1f, p2f, p1, p2, tr, depth + 1, visits);
+	if (t1 < 0 && t2 < 0) return hullCheck(clip, count, head, node.children[1], p1f, p2f, p1, p2, tr, depth + 1, visits);
+
+	// stop just short of the plane on p1's side
+	f32 frac = (t1 < 0) ? (t1 + DIST_EPSILON) / (t1 - t2) : (t1 - DIST_EPSILON) / (t1 - t2);
+	if (!(frac >= 0)) frac = 0; // NaN too, from a plane that isn't finite
+	if (frac > 1) frac = 1;
+	f32 midf = p1f + (p2f - p1f) * frac;
+	f32 mid[3];
+	for (int c = 0; c < 3; c++) mid[c] = p1[c] + frac * (p2[c] - p1[c]);
+
+	int side = (t1 < 0) ? 1 : 0;
+	if (!hullCheck(clip, count, head, node.children[side], p1f, midf, p1, mid, tr, depth + 1, visits)) return false;
+
+	if (hullContents(clip, count, node.children[side ^ 1], mid) != CONTENTS_SOLID) {
+		return hullCheck(clip, count, head, node.children[side ^ 1], midf, p2f, mid, p2, tr, depth + 1, visits);
+	}
+	if (tr->allsolid) return false; // never got out of the solid area
+
+	// the far side is solid, so this is the impact point
+	for (int c = 0; c < 3; c++) tr->normal[c] = side ? -plane.normal[c] : plane.normal[c];
+	tr->dist = side ? -plane.dist : plane.dist;
+
+	// the epsilon can leave mid inside something else; back up until it isn't
+	while (hullContents(clip, count, head, mid) == CONTENTS_SOLID) {
+		frac -= 0.1f;
+		if (frac < 0) break;
+		midf = p1f + (p2f - p1f) * frac;
+		for (int c = 0; c < 3; c++) mid[c] = p1[c] + frac * (p2[c] - p1[c]);
+	}
+	tr->fraction = midf;
+	memcpy(tr->endpos, mid, sizeof(mid));
+	return false;
+}
+
+bool bspdata::trace(const f32 start[3], const f32 end[3], int hull, bsp_trace* tr, int model) const
+{
+	memset(tr, 0, sizeof(bsp_trace));
+	tr->allsolid = true;
+	tr->fraction = 1;
+	memcpy(tr->endpos, end, sizeof(tr->endpos));
+
+	const dclipnode2_t* clip;
+	int count, head;
+	if (!hullFor(hull, model, &clip, &count, &head)) return false;
+	int visits = 0;
+	hullCheck(clip, count, head, head, 0, 1, start, end, tr, 0, &visits);
+	return true;
+}
+
+bool bspdata::traceBox(const f32 start[3], const f32 end[3], const f32 mins[3], const f32 maxs[3], bsp_trace* tr,
+	int model) const
+{
+	// the hull the game would pick for a box this wide
+	f32 width = maxs[0] - mins[0];
+	int hull = width < 3 ? 0 : (width <= 32 ? 1 : 2);
+
+	// hulls are built around a box's hull mins, not its origin
+	f32 offset[3], s[3], e[3];
+	for (int c = 0; c < 3; c++) {
+		offset[c] = hullMins[hull][c] - mins[c];
+		s[c] = start[c] - offset[c];
+		e[c] = end[c] - offset[c];
+	}
+	if (!trace(s, e, hull, tr, model)) return false;
+	for (int c = 0; c < 3; c++) tr->endpos[c] += offset[c];
+	return true;
+}
+
+// runs fn over [0, count) in one contiguous slice per thread
+template<typename F>
+static void parallelSlices(int count, int threads, F fn) {
+	if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+	threads = std::max(1, std::min(threads, count / 1024 + 1));
+	std::vector<std::thread> workers;
+	int per = (count + threads - 1) / threads;
+	for (int t = 1; t < threads; t++) {
+		int begin = t * per, end = std::min(count, begin + per);
+		if (begin < end) workers.emplace_back(fn, begin, end);
+	}
+	fn(0, std::min(count, per));
+	for (auto& w: workers) w.join();
+}
+
+void bspdata::pointContentsBatch(const f32* points, int count, int hull, int* out, int model, int threads) const
+{
+	const dclipnode2_t* clip;
+	int nclip, head;
+	if (!hullFor(hull, model, &clip, &nclip, &head)) {
+		for (int i = 0; i < count; i++) out[i] = 0;
+		return;
+	}
+	parallelSlices(count, threads, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) out[i] = hullContents(clip, nclip, head, points + i * 3);
+	});
+}
+
+void bspdata::traceBatch(const f32* starts, const f32* ends, int count, int hull, bsp_trace* out, int model,
+	int threads) const
+{
+	// materialize the lumps once, before the threads all wait on them
+	const dclipnode2_t* clip;
+	int nclip, head;
+	hullFor(hull, model, &clip, &nclip, &head);
+	parallelSlices(count, threads, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) trace(starts + i * 3, ends + i * 3, hull, out + i, model);
+	});
+}
@@ -0,0 +1,197 @@
+#include "bspdata.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define MAX_MIPTEX_SIZE 4096 // widest or tallest texture taken as real
+
+bool bspdata::checkLumps() const
+{
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		const lump_t& l = header.lumps[i];
+		if (l.fileofs < 0 || l.filelen < 0 || (size_t)l.fileofs + (size_t)l.filelen > size) {
+			fprintf(stderr, "Lump %i runs past the end of the map.\n", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+int bspdata::repairMiptex(int i, size_t avail)
+{
+	miptex_t* mt = miptexList + i;
+	int repaired = 0;
+	mt->name[sizeof(mt->name) - 1] = 0;
+	if (mt->name[0] == 0) {
+		snprintf(mt->name, sizeof(mt->name), "missing%i", i);
+		repaired++;
+	}
+	if (mt->width <= 0 || mt->height <= 0 || mt->width > MAX_MIPTEX_SIZE || mt->height > MAX_MIPTEX_SIZE) {
+		mt->width = mt->height = 16;
+		memset(mt->offsets, 0, sizeof(mt->offsets));
+		return repaired + 1;
+	}
+	// a level that doesn't fit reads as blank
+	for (int m = 0; m < MIPLEVELS; m++) {
+		size_t bytes = (size_t)(mt->width >> m) * (mt->height >> m);
+		if (mt->offsets[m] != 0 && (mt->offsets[m] > avail || bytes > avail - mt->offsets[m])) {
+			mt->offsets[m] = 0;
+			repaired++;
+		}
+	}
+	return repaired;
+}
+
+int bspdata::repairEdges(dedge2_t* e, int n)
+{
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < 2; k++) {
+			if (e[i].v[k] >= (unsigned int)numVertices) {
+				e[i].v[k] = 0;
+				repaired++;
+			}
+		}
+	}
+	return repaired;
+}
+
+// edge 0 is never drawn, so it's what a bad surfedge falls back to
+int bspdata::repairEdgeLists(int* ledges, int n)
+{
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		if (ledges[i] >= numEdges || ledges[i] <= -numEdges) {
+			ledges[i] = 0;
+			repaired++;
+		}
+	}
+	return repaired;
+}
+
+// pointed at miptex 0, which always exists (blank if the map has no
+// textures), so they can still be classified; repairFaces drops their faces
+int bspdata::repairTexInfos(texinfo_t* ti, int n)
+{
+	int repaired = 0;
+	badTexInfos.assign(n, false);
+	for (int i = 0; i < n; i++) {
+		if (ti[i].miptex < 0 || ti[i].miptex >= miptexListLen) {
+			ti[i].miptex = 0;
+			badTexInfos[i] = true;
+			repaired++;
+		}
+	}
+	return repaired;
+}
+
+// a face with anything out of range keeps no edges, so the mesh builder
+// skips it like any other degenerate face
+int bspdata::repairFaces(dface2_t* f, int n)
+{
+	texInfos.get(); // fills badTexInfos
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		bool ok = f[i].texinfo >= 0 && f[i].texinfo < numTexInfos && !badTexInfos[f[i].texinfo]
+			&& f[i].planenum >= 0 && f[i].planenum < numPlanes
+			&& f[i].firstedge >= 0 && f[i].numedges >= 0
+			&& (long long)f[i].firstedge + f[i].numedges <= numEdgeLists
+			&& numEdges > 0 && numVertices > 0;
+		if (!ok) {
+			f[i].texinfo = 0;
+			f[i].numedges = 0;
+			f[i].firstedge = 0;
+			repaired++;
+		}
+	}
+	return repaired;
+}
+
+int bspdata::repairModels(dmodel_t* m, int n)
+{
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		if (m[i].firstface < 0 || m[i].numfaces < 0 || (long long)m[i].firstface + m[i].numfaces > numFaces) {
+			m[i].firstface = 0;
+			m[i].numfaces = 0;
+			repaired++;
+		}
+	}
+	return repaired;
+}
+
+// qbsp writes a node before its children, so a child that isn't a later
+// node is a cycle or a stray; it's pointed at leaf 0, the solid leaf
+int bspdata::repairNodes(dnode2_t* nd, int n)
+{
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		if (nd[i].planenum < 0 || nd[i].planenum >= numPlanes) {
+			nd[i].planenum = 0;
+			nd[i].children[0] = nd[i].children[1] = -1;
+			repaired++;
+		}
+		for (int k = 0; k < 2; k++) {
+			int child = nd[i].children[k];
+			bool ok = child >= 0 ? child > i && child < n : -1 - child < numLeaves;
+			if (!ok) {
+				nd[i].children[k] = -1;
+				repaired++;
+			}
+		}
+		if (nd[i].firstface > (unsigned int)numFaces || nd[i].numfaces > numFaces - nd[i].firstface) {
+			nd[i].firstface = 0;
+			nd[i].numfaces = 0;
+			repaired++;
+		}
+	}
+	return repaired;
+}
+
+// the same order holds within each hull; negative children are contents
+int bspdata::repairClipNodes(dclipnode2_t* c, int n)
+{
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		if (c[i].planenum < 0 || c[i].planenum >= numPlanes) {
+			c[i].planenum = 0;
+			c[i].children[0] = c[i].children[1] = CONTENTS_SOLID;
+			repaired++;
+		}
+		for (int k = 0; k < 2; k++) {
+			int child = c[i].children[k];
+			bool ok = child >= 0 ? child > i && child < n : child >= CONTENTS_CURRENT_DOWN;
+			if (!ok) {
+				c[i].children[k] = CONTENTS_SOLID;
+				repaired++;
+			}
+		}
+	}
+	return repaired;
+}
+
+int bspdata::repairLeaves(dleaf2_t* l, int n)
+{
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		if ((unsigned long long)l[i].firstmarksurface + l[i].nummarksurfaces > (unsigned int)numFaceLists) {
+			l[i].firstmarksurface = 0;
+			l[i].nummarksurfaces = 0;
+			repaired++;
+		}
+	}
+	return repaired;
+}
+
+// face 0 stands in for a bad one
+int bspdata::repairFaceLists(unsigned int* marks, int n)
+{
+	int repaired = 0;
+	for (int i = 0; i < n; i++) {
+		if (marks[i] >= (unsigned int)numFaces) {
+			marks[i] = 0;
+			repaired++;
+		}
+	}
+	return repaired;
+}
@@ -0,0 +1,429 @@
+#include "bvh.hpp"
+#include <fcntl.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+
+// plain compares; fminf and fmaxf end up as library calls in the hot loops
+static inline f32 minf(f32 a, f32 b) { return a < b ? a : b; }
+static inline f32 maxf(f32 a, f32 b) { return a > b ? a : b; }
+
+struct bvh_bounds {
+	f32 mins[3], maxs[3];
+
+	void clear() {
+		for (int c = 0; c < 3; c++) {
+			mins[c] = FLT_MAX;
+			maxs[c] = -FLT_MAX;
+		}
+	}
+	void grow(const f32* p) {
+		for (int c = 0; c < 3; c++) {
+			mins[c] = minf(mins[c], p[c]);
+			maxs[c] = maxf(maxs[c], p[c]);
+		}
+	}
+	void grow(const bvh_bounds& b) {
+		grow(b.mins);
+		grow(b.maxs);
+	}
+	f32 area() const {
+		f32 d[3];
+		for (int c = 0; c < 3; c++) d[c] = maxs[c] > mins[c] ? maxs[c] - mins[c] : 0;
+		return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+	}
+};
+
+// what every build task shares; tasks only touch disjoint slices of order
+struct bvh_build {
+	std::vector<bvh_bounds> bounds; // per triangle
+	std::vector<f32> centroids; // three per triangle
+	std::vector<u32> order;
+	int spawnDepth; // levels that still hand a child to a new thread
+};
+
+// Binned SAH over the centroids: returns the axis and the bin boundary to
+// split at, or -1 when keeping the node as a leaf is cheaper.
+static int findSplit(const bvh_build& b, u32 first, u32 count, const bvh_bounds& node, int* bestBin, f32* cmin, f32* cscale) {
+	bvh_bounds cb;
+	cb.clear();
+	for (u32 i = first; i < first + count; i++) cb.grow(&b.centroids[b.order[i] * 3]);
+
+	int bestAxis = -1;
+	f32 bestCost = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++) {
+		f32 extent = cb.maxs[axis] - cb.mins[axis];
+		if (extent <= 1e-6f) continue;
+		f32 scale = BVH_BINS / extent;
+
+		bvh_bounds bins[BVH_BINS];
+		u32 counts[BVH_BINS] = {0};
+		for (auto& bin: bins) bin.clear();
+		for (u32 i = first; i < first + count; i++) {
+			u32 t = b.order[i];
+			int bin = (int)((b.centroids[t * 3 + axis] - cb.mins[axis]) * scale);
+			if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+			counts[bin]++;
+			bins[bin].grow(b.bounds[t]);
+		}
+
+		// sweep from the right, then score each boundary from the left
+		f32 rightArea[BVH_BINS];
+		u32 rightCount[BVH_BINS];
+		bvh_bounds acc;
+		acc.clear();
+		u32 n = 0;
+		for (int i = BVH_BINS - 1; i > 0; i--) {
+			n += counts[i];
+			if (counts[i] > 0) acc.grow(bins[i]);
+			rightArea[i] = acc.area();
+			rightCount[i] = n;
+		}
+		acc.clear();
+		n = 0;
+		for (int i = 0; i < BVH_BINS - 1; i++) {
+			n += counts[i];
+			if (counts[i] > 0) acc.grow(bins[i]);
+			if (n == 0 || rightCount[i + 1] == 0) continue;
+			f32 cost = n * acc.area() + rightCount[i + 1] * rightArea[i + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				*bestBin = i;
+				*cmin = cb.mins[axis];
+				*cscale = scale;
+			}
+		}
+	}
+
+	// one traversal step against testing every triangle here
+	f32 area = node.area();
+	if (bestAxis < 0) return -1;
+	if (count <= BVH_MAX_LEAF && area > 0 && 1 + bestCost / area >= count) return -1;
+	return bestAxis;
+}
+
+// Appends the subtree over order[first, first + count) to out, node indices
+// relative to out.
+static void buildNode(bvh_build& b, std::vector<bvh_node>& out, u32 first, u32 count, int depth) {
+	bvh_bounds nb;
+	nb.clear();
+	for (u32 i = first; i < first + count; i++) nb.grow(b.bounds[b.order[i]]);
+
+	u32 self = out.size();
+	bvh_node node;
+	memcpy(node.mins, nb.mins, sizeof(node.mins));
+	memcpy(node.maxs, nb.maxs, sizeof(node.maxs));
+	node.first = first;
+	node.count = count;
+	out.push_back(node);
+	if (count <= 2 || depth >= BVH_MAX_DEPTH) return;
+
+	int bin = 0;
+	f32 cmin = 0, cscale = 0;
+	int axis = findSplit(b, first, count, nb, &bin, &cmin, &cscale);
+	u32 mid;
+	if (axis >= 0) {
+		u32* begin = b.order.data() + first;
+		u32* split = std::partition(begin, begin + count, [&](u32 t) {
+			int tb = (int)((b.centroids[t * 3 + axis] - cmin) * cscale);
+			return (tb >= BVH_BINS ? BVH_BINS - 1 : tb) <= bin;
+		});
+		mid = split - begin;
+	} else if (count > BVH_MAX_LEAF) {
+		mid = count / 2; // all centroids together; split anyway to bound the leaf
+	} else {
+		return;
+	}
+	if (mid == 0 || mid == count) mid = count / 2;
+
+	out[self].count = 0;
+	if (depth < b.spawnDepth && count >= 4096) {
+		// the right half builds into its own array on another thread
+		std::vector<bvh_node> right;
+		std::thread worker([&]() { buildNode(b, right, first + mid, count - mid, depth + 1); });
+		buildNode(b, out, first, mid, depth + 1);
+		worker.join();
+
+		u32 base = out.size();
+		out[self].first = base;
+		for (auto n: right) {
+			if (n.count == 0) n.first += base;
+			out.push_back(n);
+		}
+	} else {
+		buildNode(b, out, first, mid, depth + 1);
+		out[self].first = out.size();
+		buildNode(b, out, first + mid, count - mid, depth + 1);
+	}
+}
+
+BVH::~BVH() {
+	if (mapped != NULL) munmap(mapped, mappedSize);
+}
+
+void BVH::build(const Mesh& mesh, int threads)
+{
+	if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+	if (threads < 1) threads = 1;
+
+	u32 ntris = mesh.indices.size() / 3;
+	bvh_build b;
+	b.bounds.resize(ntris);
+	b.centroids.resize(ntris * 3);
+	b.order.resize(ntris);
+	b.spawnDepth = 0;
+	while ((1 << b.spawnDepth) < threads) b.spawnDepth++;
+
+	for (u32 t = 0; t < ntris; t++) {
+		b.bounds[t].clear();
+		for (int k = 0; k < 3; k++) {
+			mesh_v3 v = mesh.vertices[mesh.indices[t * 3 + k]];
+			f32 p[3] = { v.x, v.y, v.z };
+			b.bounds[t].grow(p);
+		}
+		for (int c = 0; c < 3; c++) b.centroids[t * 3 + c] = (b.bounds[t].mins[c] + b.bounds[t].maxs[c]) * 0.5f;
+		b.order[t] = t;
+	}
+
+	nodeStore.clear();
+	nodeStore.reserve(ntris > 0 ? ntris * 2 - 1 : 0);
+	if (ntris > 0) buildNode(b, nodeStore, 0, ntris, 0);
+
+	// triangles again in leaf order, ready for the intersection test
+	triStore = b.order;
+	vertStore.resize(ntris * 9);
+	for (u32 i = 0; i < ntris; i++) {
+		u32 t = triStore[i];
+		mesh_v3 v0 = mesh.vertices[mesh.indices[t * 3]];
+		mesh_v3 e1 = mesh.vertices[mesh.indices[t * 3 + 1]] - v0;
+		mesh_v3 e2 = mesh.vertices[mesh.indices[t * 3 + 2]] - v0;
+		f32* out = &vertStore[i * 9];
+		out[0] = v0.x; out[1] = v0.y; out[2] = v0.z;
+		out[3] = e1.x; out[4] = e1.y; out[5] = e1.z;
+		out[6] = e2.x; out[7] = e2.y; out[8] = e2.z;
+	}
+
+	if (mapped != NULL) munmap(mapped, mappedSize);
+	mapped = NULL;
+	nodes = nodeStore.data();
+	triIds = triStore.data();
+	triVerts = vertStore.data();
+	numNodes = nodeStore.size();
+	numTris = ntris;
+}
+
+static u32 align32(u32 n) {
+	return (n + 31) & ~31u;
+}
+
+bool BVH::write(FILE* fp) const
+{
+	bvh_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ident = BVH_IDENT;
+	hdr.version = BVH_VERSION;
+	hdr.numNodes = numNodes;
+	hdr.numTris = numTris;
+	hdr.nodeofs = align32(sizeof(hdr));
+	hdr.triofs = align32(hdr.nodeofs + numNodes * sizeof(bvh_node));
+	hdr.vertofs = align32(hdr.triofs + numTris * sizeof(u32));
+	hdr.filelen = hdr.vertofs + numTris * 9 * sizeof(f32);
+
+	static const char zeros[32] = {0};
+	size_t at = 0;
+	auto put = [&](u32 ofs, const void* data, size_t bytes) {
+		bool ok = fwrite(zeros, 1, ofs - at, fp) == ofs - at;
+		ok = ok && fwrite(data, 1, bytes, fp) == bytes;
+		at = ofs + bytes;
+		return ok;
+	};
+	bool ok = put(0, &hdr, sizeof(hdr));
+	ok = put(hdr.nodeofs, nodes, numNodes * sizeof(bvh_node)) && ok;
+	ok = put(hdr.triofs, triIds, numTris * sizeof(u32)) && ok;
+	ok = put(hdr.vertofs, triVerts, numTris * 9 * sizeof(f32)) && ok;
+	return ok && ferror(fp) == 0;
+}
+
+// Walks the nodes in the depth-first order build lays them out in: every
+// node must be the next one visited, so each is reached exactly once and a
+// right child starts where its left sibling's subtree ends. That rules out
+// cycles and shared subtrees, keeps leaves inside the triangle order, and
+// holds the depth to what raycast's stack is sized for.
+static bool checkTree(const bvh_node* n, u32 numNodes, u32 numTris) {
+	if (numNodes == 0) return true;
+	u32 next = 0;
+	std::vector<std::pair<u32, int>> stack(1, std::make_pair(0u, 1));
+	while (!stack.empty()) {
+		auto top = stack.back();
+		stack.pop_back();
+		u32 i = top.first;
+		if (i != next || i >= numNodes || top.second > BVH_MAX_DEPTH + 1) return false;
+		next++;
+		if (n[i].count > 0) {
+			if ((size_t)n[i].first + n[i].count > numTris) return false;
+			continue;
+		}
+		if (n[i].first >= numNodes) return false;
+		stack.push_back(std::make_pair(n[i].first, top.second + 1));
+		stack.push_back(std::make_pair(i + 1, top.second + 1));
+	}
+	return next == numNodes;
+}
+
+bool BVH::open(const char* path)
+{
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s for reading.\n", path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bvh_header)) {
+		fprintf(stderr, "%s is too small to be a BVH.\n", path);
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s.\n", path);
+		return false;
+	}
+
+	bvh_header hdr;
+	memcpy(&hdr, data, sizeof(hdr));
+	size_t size = st.st_size;
+	bool ok = hdr.ident == BVH_IDENT && hdr.version == BVH_VERSION
+		&& hdr.nodeofs % 32 == 0 && hdr.triofs % 32 == 0 && hdr.vertofs % 32 == 0
+		&& hdr.nodeofs + (size_t)hdr.numNodes * sizeof(bvh_node) <= size
+		&& hdr.triofs + (size_t)hdr.numTris * sizeof(u32) <= size
+		&& hdr.vertofs + (size_t)hdr.numTris * 9 * sizeof(f32) <= size;
+	if (!ok) {
+		fprintf(stderr, "%s isn't a usable BVH.\n", path);
+		munmap(data, size);
+		return false;
+	}
+
+	const bvh_node* n = (const bvh_node*)((const char*)data + hdr.nodeofs);
+	if (!checkTree(n, hdr.numNodes, hdr.numTris)) {
+		fprintf(stderr, "%s has damaged nodes.\n", path);
+		munmap(data, size);
+		return false;
+	}
+
+	if (mapped != NULL) munmap(mapped, mappedSize);
+	nodeStore.clear();
+	triStore.clear();
+	vertStore.clear();
+	mapped = data;
+	mappedSize = size;
+	nodes = n;
+	triIds = (const u32*)((const char*)data + hdr.triofs);
+	triVerts = (const f32*)((const char*)data + hdr.vertofs);
+	numNodes = hdr.numNodes;
+	numTris = hdr.numTris;
+	return true;
+}
+
+int BVH::depth() const
+{
+	if (numNodes == 0) return 0;
+	int deepest = 0;
+	std::vector<std::pair<u32, int>> stack(1, std::make_pair(0u, 1));
+	while (!stack.empty()) {
+		auto top = stack.back();
+		stack.pop_back();
+		if (top.second > deepest) deepest = top.second;
+		const bvh_node& n = nodes[top.first];
+		if (n.count > 0) continue;
+		stack.push_back(std::make_pair(top.first + 1, top.second + 1));
+		stack.push_back(std::make_pair(n.first, top.second + 1));
+	}
+	return deepest;
+}
+
+// entry distance into the box, or FLT_MAX on a miss
+static inline f32 slab(const bvh_node& n, const f32* o, const f32* inv, f32 tmax) {
+	f32 t0 = 0, t1 = tmax;
+	for (int c = 0; c < 3; c++) {
+		f32 a = (n.mins[c] - o[c]) * inv[c];
+		f32 b = (n.maxs[c] - o[c]) * inv[c];
+		t0 = maxf(t0, minf(a, b));
+		t1 = minf(t1, maxf(a, b));
+	}
+	return t0 <= t1 ? t0 : FLT_MAX;
+}
+
+bool BVH::raycast(const f32 origin[3], const f32 dir[3], f32 tmax, bvh_hit* hit) const
+{
+	if (numNodes == 0) return false;
+	f32 inv[3];
+	for (int c = 0; c < 3; c++) inv[c] = 1.0f / dir[c];
+	if (slab(nodes[0], origin, inv, tmax) == FLT_MAX) return false;
+
+	bool found = false;
+	u32 stack[BVH_MAX_DEPTH + 4];
+	int sp = 0;
+	u32 ni = 0;
+	while (true) {
+		const bvh_node& n = nodes[ni];
+		if (n.count > 0) {
+			// Moller-Trumbore against each triangle in the leaf
+			for (u32 i = n.first; i < n.first + n.count; i++) {
+				const f32* v = triVerts + i * 9;
+				const f32 *e1 = v + 3, *e2 = v + 6;
+				f32 p[3] = { dir[1] * e2[2] - dir[2] * e2[1], dir[2] * e2[0] - dir[0] * e2[2], dir[0] * e2[1] - dir[1] * e2[0] };
+				f32 det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+				if (fabsf(det) < 1e-12f) continue;
+				f32 invdet = 1.0f / det;
+				f32 s[3] = { origin[0] - v[0], origin[1] - v[1], origin[2] - v[2] };
+				f32 u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invdet;
+				if (u < 0 || u > 1) continue;
+				f32 q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+				f32 w = (dir[0] * q[0] + dir[1] * q[1] + dir[2] * q[2]) * invdet;
+				if (w < 0 || u + w > 1) continue;
+				f32 t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invdet;
+				if (t <= 0 || t >= tmax) continue;
+				if (hit == NULL) return true;
+				tmax = t;
+				found = true;
+				hit->triangle = triIds[i];
+				hit->t = t;
+				hit->u = u;
+				hit->v = w;
+			}
+		} else {
+			// nearer child first; the other waits on the stack
+			u32 a = ni + 1, b = n.first;
+			f32 ta = slab(nodes[a], origin, inv, tmax);
+			f32 tb = slab(nodes[b], origin, inv, tmax);
+			if (ta > tb) {
+				std::swap(a, b);
+				std::swap(ta, tb);
+			}
+			if (ta != FLT_MAX) {
+				if (tb != FLT_MAX) stack[sp++] = b;
+				ni = a;
+				continue;
+			}
+		}
+
+		// pop, skipping boxes that now start past the nearest hit
+		bool next = false;
+		while (sp > 0) {
+			ni = stack[--sp];
+			if (slab(nodes[ni], origin, inv, tmax) != FLT_MAX) {
+				next = true;
+				break;
+			}
+		}
+		if (!next) break;
+	}
+	return found;
+}
@@ -0,0 +1,78 @@
+#ifndef BVH_H_INCLUDED
+#define BVH_H_INCLUDED
+
+#include "common.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <vector>
+#include "mesh.hpp"
+
+#define BVH_IDENT (('1'<<24)|('H'<<16)|('V'<<8)|'B') // "BVH1"
+#define BVH_VERSION 1
+#define BVH_BINS 16 // SAH candidates per axis
+#define BVH_MAX_LEAF 8 // triangles a leaf may hold when a split would still pay
+#define BVH_MAX_DEPTH 60 // leaves are forced past this; raycast's stack relies on it
+
+// Depth-first flattened node, 32 bytes so two share a cache line. The left
+// child of an interior node is always the next node.
+struct bvh_node {
+	f32 mins[3];
+	u32 first; // leaf: first slot in the triangle order; interior: right child
+	f32 maxs[3];
+	u32 count; // triangles in a leaf, 0 for an interior node
+};
+
+// A .bvh file is this header followed by the nodes, the triangle order and
+// the triangle corners, each section 32-byte aligned and stored
+// little-endian, so a loader can use the sections in place.
+struct bvh_header {
+	int ident;
+	int version;
+	u32 numNodes, numTris;
+	u32 nodeofs, triofs, vertofs; // byte offsets from the start of the file
+	u32 filelen;
+};
+
+struct bvh_hit {
+	u32 triangle; // in the mesh's index order, i.e. the OBJ's f lines from 0
+	f32 t, u, v; // distance along the ray and barycentrics
+};
+
+// Bounding volume hierarchy over a mesh's triangles, built by binned SAH with
+// the upper levels split across threads. Triangles are stored again in leaf
+// order, as one corner and two edges, so a loaded file answers rays without
+// the mesh.
+class BVH {
+	std::vector<bvh_node> nodeStore;
+	std::vector<u32> triStore;
+	std::vector<f32> vertStore;
+
+	const bvh_node* nodes = NULL;
+	const u32* triIds = NULL; // original triangle of each slot
+	const f32* triVerts = NULL; // nine floats per slot: v0, v1 - v0, v2 - v0
+	u32 numNodes = 0, numTris = 0;
+
+	void* mapped = NULL;
+	size_t mappedSize = 0;
+public:
+	BVH() { }
+	~BVH();
+	BVH(const BVH& other) = delete;
+
+	// threads <= 0 uses one per core
+	void build(const Mesh& mesh, int threads = 0);
+	bool write(FILE* fp) const;
+	// maps a file written by write; nothing is copied
+	bool open(const char* path);
+
+	u32 nodeCount() const { return numNodes; }
+	u32 triangleCount() const { return numTris; }
+	int depth() const;
+
+	// nearest hit along dir (needn't be unit length) with t < tmax; with a
+	// NULL hit it only asks whether anything is in the way, and stops at the
+	// first triangle found
+	bool raycast(const f32 origin[3], const f32 dir[3], f32 tmax, bvh_hit* hit) const;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "libbsp2obj.h"
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include "bspdata.hpp"
+#include "mesh.hpp"
+
+// The C API is an FFI boundary: nothing may throw across it, so allocation
+// failures inside the converter come back as NULL or -1.
+
+struct bsp2obj_map {
+	bspdata bsp;
+};
+
+struct bsp2obj_mesh {
+	Mesh mesh;
+};
+
+int bsp2obj_api_version(void) {
+	return BSP2OBJ_API_VERSION;
+}
+
+bsp2obj_map* bsp2obj_load_file(const char* path) {
+	if (path == NULL) return NULL;
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Couldn't open %s for reading.\n", path);
+		return NULL;
+	}
+	bsp2obj_map* map = new (std::nothrow) bsp2obj_map;
+	bool ok = false;
+	if (map != NULL) {
+		try {
+			ok = map->bsp.loadFromFilePointer(fp);
+		} catch (...) { }
+	}
+	fclose(fp);
+	if (!ok) {
+		delete map;
+		return NULL;
+	}
+	return map;
+}
+
+bsp2obj_map* bsp2obj_load_memory(const void* data, size_t size) {
+	if (data == NULL) return NULL;
+	bsp2obj_map* map = new (std::nothrow) bsp2obj_map;
+	if (map == NULL) return NULL;
+	bool ok = false;
+	try {
+		ok = map->bsp.loadFromMemory(data, size);
+	} catch (...) { }
+	if (!ok) {
+		delete map;
+		return NULL;
+	}
+	return map;
+}
+
+void bsp2obj_free_map(bsp2obj_map* map) {
+	delete map;
+}
+
+void bsp2obj_default_mesh_options(bsp2obj_mesh_options* opts) {
+	if (opts == NULL) return;
+	opts->center = 1;
+	opts->scale = 0.1f;
+	opts->yup = 1;
+}
+
+bsp2obj_mesh* bsp2obj_build_mesh(const bsp2obj_map* map, const bsp2obj_mesh_options* opts) {
+	if (map == NULL) return NULL;
+	bsp2obj_mesh_options defaults;
+	bsp2obj_default_mesh_options(&defaults);
+	if (opts == NULL) opts = &defaults;
+
+	try {
+		// the build only reads the map
+		bsp2obj_mesh* out = new bsp2obj_mesh{ Mesh::FromBSPData(const_cast<bspdata*>(&map->bsp)) };
+		Mesh& mesh = out->mesh;
+		if (opts->center) {
+			mesh_v3 bmin, bmax;
+			mesh.getBoundingBox(&bmin, &bmax);
+			mesh.translate(-((bmin + bmax) * 0.5));
+		}
+		if (opts->scale != 1.0f) mesh.scale(opts->scale);
+		if (opts->yup) mesh.rotate(-PiOver2, mesh_v3{1.0, 0, 0});
+		return out;
+	} catch (...) {
+		return NULL;
+	}
+}
+
+void bsp2obj_free_mesh(bsp2obj_mesh* mesh) {
+	delete mesh;
+}
+
+int bsp2obj_mesh_get_info(const bsp2obj_mesh* mesh, bsp2obj_mesh_info* info) {
+	if (mesh == NULL || info == NULL) return -1;
+	info->vertices = mesh->mesh.vertices.size();
+	info->indices = mesh->mesh.indices.size();
+	info->materials = mesh->mesh.ranges.size();
+	return 0;
+}
+
+int bsp2obj_mesh_copy_positions(const bsp2obj_mesh* mesh, float* xyz, size_t count) {
+	if (mesh == NULL || xyz == NULL) return -1;
+	const VertexStream& v = mesh->mesh.vertices;
+	if (count < v.size() * 3) return -1;
+	for (size_t i = 0; i < v.size(); i++) {
+		xyz[i * 3] = v.x()[i];
+		xyz[i * 3 + 1] = v.y()[i];
+		xyz[i * 3 + 2] = v.z()[i];
+	}
+	return 0;
+}
+
+int bsp2obj_mesh_copy_texcoords(const bsp2obj_mesh* mesh, float* uv, size_t count) {
+	if (mesh == NULL || uv == NULL) return -1;
+	const std::vector<mesh_v2>& t = mesh->mesh.texcoords;
+	if (count < t.size() * 2) return -1;
+	for (size_t i = 0; i < t.size(); i++) {
+		uv[i * 2] = t[i].x;
+		uv[i * 2 + 1] = t[i].y;
+	}
+	return 0;
+}
+
+int bsp2obj_mesh_copy_normals(const bsp2obj_mesh* mesh, float* xyz, size_t count) {
+	if (mesh == NULL || xyz == NULL) return -1;
+	const Mesh& m = mesh->mesh;
+	if (count < m.vertices.size() * 3) return -1;
+
+	// normals are shared per face group; every vertex belongs to one face
+	memset(xyz, 0, m.vertices.size() * 3 * sizeof(float));
+	for (const auto& g: m.groups) {
+		mesh_v3 n = m.normals[g.normal];
+		for (u32 i = g.firstIndex; i < g.firstIndex + g.numTris * 3; i++) {
+			u32 v = m.indices[i];
+			xyz[v * 3] = n.x;
+			xyz[v * 3 + 1] = n.y;
+			xyz[v * 3 + 2] = n.z;
+		}
+	}
+	return 0;
+}
+
+int bsp2obj_mesh_copy_indices(const bsp2obj_mesh* mesh, uint32_t* indices, size_t count) {
+	if (mesh == NULL || indices == NULL) return -1;
+	const IndexStream& idx = mesh->mesh.indices;
+	if (count < idx.size()) return -1;
+	for (size_t i = 0; i < idx.size(); i++) indices[i] = idx[i];
+	return 0;
+}
+
+int bsp2obj_mesh_copy_materials(const bsp2obj_mesh* mesh, bsp2obj_material* materials, size_t count) {
+	if (mesh == NULL || materials == NULL) return -1;
+	const Mesh& m = mesh->mesh;
+	if (count < m.ranges.size()) return -1;
+	for (size_t i = 0; i < m.ranges.size(); i++) {
+		const mesh_mat& mat = m.materials[m.ranges[i].material];
+		memset(&materials[i], 0, sizeof(bsp2obj_material));
+		memcpy(materials[i].name, mat.name, sizeof(materials[i].name) - 1);
+		materials[i].texture = mat.miptex;
+		materials[i].firstIndex = m.ranges[i].firstIndex;
+		materials[i].numIndices = m.ranges[i].numIndices;
+	}
+	return 0;
+}
+
+int bsp2obj_texture_count(const bsp2obj_map* map) {
+	if (map == NULL) return -1;
+	return map->bsp.miptexListLen;
+}
+
+int bsp2obj_texture_info(const bsp2obj_map* map, int texture, bsp2obj_texture* info) {
+	if (map == NULL || info == NULL) return -1;
+	if (texture < 0 || texture >= map->bsp.miptexListLen) return -1;
+	const miptex_t& mt = map->bsp.miptexList[texture];
+	memset(info, 0, sizeof(bsp2obj_texture));
+	memcpy(info->name, mt.name, sizeof(mt.name));
+	info->width = mt.width;
+	info->height = mt.height;
+	info->levels = 0;
+	for (int m = 0; m < MIPLEVELS && (mt.width >> m) > 0 && (mt.height >> m) > 0; m++) info->levels++;
+	return 0;
+}
+
+int bsp2obj_decode_texture(const bsp2obj_map* map, int texture, int level, int keyed,
+	unsigned char* rgba, size_t size)
+{
+	if (map == NULL || rgba == NULL) return -1;
+	if (texture < 0 || texture >= map->bsp.miptexListLen) return -1;
+	if (level < 0 || level >= MIPLEVELS) return -1;
+
+	int w, h;
+	const unsigned char* data = map->bsp.getMipLevel(texture, level, &w, &h);
+	if (w < 1 || h < 1 || size < (size_t)w * h * 4) return -1;
+	expandPalette(data, w * h, rgba, keyed != 0);
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include "chunkwriter.hpp"
+#include <stdarg.h>
+#include <string.h>
+
+ChunkWriter::ChunkWriter(FILE* out, size_t chunkbytes, size_t depth)
+	: fp(out), chunkSize(chunkbytes), chunk(chunkbytes), queue(depth)
+{
+	writer = std::thread([this]() {
+		std::vector<char> buf;
+		while (queue.pop(buf)) {
+			// keep draining after a failure so the producer never blocks on a full queue
+			if (!failed && fwrite(buf.data(), 1, buf.size(), fp) != buf.size()) failed = true;
+		}
+	});
+}
+
+ChunkWriter::~ChunkWriter() {
+	finish();
+}
+
+void ChunkWriter::flushChunk() {
+	if (used == 0) return;
+	chunk.resize(used);
+	queue.push(std::move(chunk));
+	chunk = std::vector<char>(chunkSize);
+	used = 0;
+}
+
+void ChunkWriter::printf(const char* fmt, ...) {
+	va_list args, retry;
+	va_start(args, fmt);
+	va_copy(retry, args);
+	int n = vsnprintf(chunk.data() + used, chunk.size() - used, fmt, args);
+	va_end(args);
+
+	if (n >= 0 && (size_t)n >= chunk.size() - used) {
+		// didn't fit: ship what we have and format again into a fresh chunk,
+		// growing it if this one line is larger than a whole chunk
+		flushChunk();
+		if ((size_t)n + 1 > chunk.size()) chunk.resize(n + 1);
+		n = vsnprintf(chunk.data(), chunk.size(), fmt, retry);
+	}
+	va_end(retry);
+
+	if (n > 0) used += n;
+	if (used == chunk.size() - 1) flushChunk();
+}
+
+void ChunkWriter::write(const char* data, size_t len) {
+	while (len > 0) {
+		size_t room = chunk.size() - used;
+		size_t n = len < room ? len : room;
+		memcpy(chunk.data() + used, data, n);
+		used += n;
+		data += n;
+		len -= n;
+		if (used == chunk.size()) flushChunk();
+	}
+}
+
+void ChunkWriter::append(std::vector<char>&& text) {
+	if (text.empty()) return;
+	flushChunk();
+	queue.push(std::move(text));
+}
+
+void TextBuffer::printf(const char* fmt, ...) {
+	if (data.size() - used < 256) data.resize(std::max((size_t)4096, data.size() * 2));
+
+	va_list args, retry;
+	va_start(args, fmt);
+	va_copy(retry, args);
+	int n = vsnprintf(data.data() + used, data.size() - used, fmt, args);
+	va_end(args);
+	if (n >= 0 && (size_t)n >= data.size() - used) {
+		data.resize(used + n + 1);
+		n = vsnprintf(data.data() + used, data.size() - used, fmt, retry);
+	}
+	va_end(retry);
+	if (n > 0) used += n;
+}
+
+void TextBuffer::write(const char* text, size_t len) {
+	if (data.size() - used < len) data.resize(std::max(std::max((size_t)4096, data.size() * 2), used + len));
+	memcpy(data.data() + used, text, len);
+	used += len;
+}
+
+std::vector<char> TextBuffer::take() {
+	data.resize(used);
+	used = 0;
+	std::vector<char> text;
+	text.swap(data);
+	return text;
+}
+
+bool ChunkWriter::finish() {
+	if (finished) return !failed;
+	finished = true;
+	flushChunk();
+	queue.close();
+	writer.join();
+	return !failed;
+}
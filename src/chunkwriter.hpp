@@ -0,0 +1,94 @@
+#ifndef CHUNKWRITER_H_INCLUDED
+#define CHUNKWRITER_H_INCLUDED
+
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "boundedqueue.hpp"
+
+#define FORMAT_BLOCK 16384 // most items a worker formats into one buffer
+#define FORMAT_BLOCK_MIN 256 // fewest, below which a thread isn't worth starting
+
+// Growable text buffer for formatting away from a ChunkWriter.
+class TextBuffer {
+	std::vector<char> data;
+	size_t used = 0;
+public:
+	void printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+	void write(const char* text, size_t len);
+	// hands over the text, leaving the buffer empty
+	std::vector<char> take();
+};
+
+// Formats into fixed-size chunks and hands each full one to a writer thread,
+// so formatting never waits on the disk. At most depth chunks are in flight.
+// The FILE belongs to the writer thread until finish() returns.
+class ChunkWriter {
+	FILE* fp;
+	size_t chunkSize;
+	std::vector<char> chunk;
+	size_t used = 0;
+	BoundedQueue<std::vector<char>> queue;
+	std::thread writer;
+	bool failed = false; // only touched by the writer thread until it's joined
+	bool finished = false;
+
+	void flushChunk();
+public:
+	ChunkWriter(FILE* out, size_t chunkbytes = 1 << 18, size_t depth = 4);
+	~ChunkWriter();
+	ChunkWriter(const ChunkWriter& other) = delete;
+
+	void printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+	void write(const char* data, size_t len);
+	// queues a finished buffer as it is, after what's been written so far
+	void append(std::vector<char>&& text);
+	// Formats items [0, count) on up to threads threads (0 for one per core),
+	// format(lo, hi, buf) appending the text of items [lo, hi) to buf, and
+	// writes the text in item order: the same bytes formatting them all here
+	// would give. Blocks are count / threads items, kept between
+	// FORMAT_BLOCK_MIN and FORMAT_BLOCK, and go out in waves of one block
+	// per thread, so every thread gets work and only a wave's text is held.
+	template<typename F>
+	void formatBlocks(size_t count, int threads, F format);
+	// the same, with format(i, buf) called for each item
+	template<typename F>
+	void formatParallel(size_t count, int threads, F format);
+	// flushes, waits for the writer and reports whether every chunk made it
+	bool finish();
+};
+
+template<typename F>
+void ChunkWriter::formatBlocks(size_t count, int threads, F format)
+{
+	if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+	if (threads < 1) threads = 1;
+	size_t size = (count + threads - 1) / threads;
+	size = std::max((size_t)FORMAT_BLOCK_MIN, std::min((size_t)FORMAT_BLOCK, size));
+	size_t blocks = (count + size - 1) / size;
+
+	std::vector<TextBuffer> wave(std::min(blocks, (size_t)threads));
+	for (size_t first = 0; first < blocks; first += wave.size()) {
+		size_t n = std::min(wave.size(), blocks - first);
+		auto fill = [&](size_t b) {
+			size_t lo = (first + b) * size;
+			format(lo, std::min(count, lo + size), wave[b]);
+		};
+		std::vector<std::thread> workers;
+		for (size_t b = 1; b < n; b++) workers.emplace_back(fill, b);
+		fill(0);
+		for (auto& w: workers) w.join();
+		for (size_t b = 0; b < n; b++) append(wave[b].take());
+	}
+}
+
+template<typename F>
+void ChunkWriter::formatParallel(size_t count, int threads, F format)
+{
+	formatBlocks(count, threads, [&](size_t lo, size_t hi, TextBuffer& buf) {
+		for (size_t i = lo; i < hi; i++) format(i, buf);
+	});
+}
+
+#endif
@@ -4,6 +4,8 @@
 typedef float f32;
 typedef double f64;
 typedef long long int s64;
+typedef unsigned int u32;
+typedef unsigned short u16;
 
 static const f32 PiOver2 = 1.5707963268f;
 
@@ -0,0 +1,300 @@
+#include "daemon.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "boundedqueue.hpp"
+#include "bspcache.hpp"
+#include "pipeline.hpp"
+
+#define SEND_TIMEOUT 30 // seconds a worker waits on a client that isn't reading its answers
+
+struct daemon_state {
+	BSPCache cache;
+	// one per set of texture files (directory and extension): different
+	// maps, or the same map under different keys, can write the same files
+	std::mutex fileLocksLock;
+	std::map<std::string, std::unique_ptr<std::mutex>> fileLocks;
+
+	explicit daemon_state(int cacheSize) : cache(cacheSize) { }
+
+	std::mutex& filesLock(const std::string& files) {
+		std::lock_guard<std::mutex> guard(fileLocksLock);
+		std::unique_ptr<std::mutex>& m = fileLocks[files];
+		if (!m) m.reset(new std::mutex());
+		return *m;
+	}
+};
+
+// one request, handed from the connection loop to a worker
+struct daemon_request {
+	int fd;
+	std::string line;
+};
+
+// a worker's answer went out, or couldn't
+struct daemon_reply {
+	int fd;
+	bool sent;
+};
+
+static std::vector<std::string> splitFields(const std::string& line) {
+	std::vector<std::string> fields;
+	std::string::size_type start = 0;
+	while (true) {
+		std::string::size_type tab = line.find('\t', start);
+		fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+		if (tab == std::string::npos) break;
+		start = tab + 1;
+	}
+	return fields;
+}
+
+// everything that picks which texture files come out of an extraction
+static std::string textureKey(const convert_options& opts) {
+	char key[64];
+	snprintf(key, sizeof(key), "|%s|%i|%i|%i|%i", textureExtension(opts.texformat), opts.compress ? 1 : 0,
+		(int)opts.bc.opaque, (int)opts.bc.keyed, (int)opts.bc.quality);
+	return std::string(opts.texdir) + key;
+}
+
+static std::string handleRequest(daemon_state* state, const std::string& line)
+{
+	std::vector<std::string> fields = splitFields(line);
+	if (fields.size() < 3) return "error: expected infile, outfile and matfile";
+
+	convert_options opts;
+	std::vector<const char*> args;
+	for (const auto& f: fields) args.push_back(f.c_str());
+	for (int i = 3; i < (int)args.size(); i++) {
+		std::string err;
+		if (!parseConvertOption(args.size(), args.data(), &i, &opts, &err)) return "error: " + err;
+	}
+
+	convert_job job = { fields[0], fields[1], fields[2] };
+	if (job.infile == "-" || job.outfile == "-") return "error: the daemon has no stdin or stdout to offer";
+	bool hit = false;
+	auto bsp = state->cache.get(job.infile.c_str(), &hit);
+	if (!bsp) return "error: couldn't load " + job.infile;
+
+	std::unique_ptr<OutputSink> sink(createOutputSink(opts));
+	if (!sink) return "error: couldn't create the archive";
+
+	// an archive is new every time, so it always gets its own textures
+	const bc_options* bc = opts.compress ? &opts.bc : NULL;
+	if (opts.textures && opts.archive != NULL) {
+		if (!bsp->extractTextures(opts.texdir, opts.texformat, bc, sink.get())) {
+			return "error: couldn't extract the textures";
+		}
+	} else if (opts.textures) {
+		bool extracted = state->cache.extractTextures(bsp.get(), textureKey(opts), [&]() {
+			std::string files = std::string(opts.texdir) + "|" + textureExtension(opts.texformat);
+			std::lock_guard<std::mutex> guard(state->filesLock(files));
+			return bsp->extractTextures(opts.texdir, opts.texformat, bc, sink.get());
+		});
+		if (!extracted) return "error: couldn't extract the textures";
+	}
+
+	FILE *report = NULL;
+	if (opts.reportfile != NULL) {
+		report = fopen(opts.reportfile, "w");
+		if (report == NULL) fprintf(stderr, "Couldn't open %s for writing.\n", opts.reportfile);
+	}
+	bool ok = convertLoadedMap(job, bsp.get(), opts, sink.get(), report, false);
+	if (report != NULL) fclose(report);
+	TarSink* tar = dynamic_cast<TarSink*>(sink.get());
+	if (tar != NULL) ok = tar->finish() && ok;
+
+	if (!ok) return "error: couldn't convert " + job.infile;
+	return hit ? "ok cached" : "ok loaded";
+}
+
+static bool sendLine(int fd, const std::string& line) {
+	std::string out = line + "\n";
+	size_t sent = 0;
+	while (sent < out.size()) {
+		ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		sent += n;
+	}
+	return true;
+}
+
+// A client connection, as the connection loop sees it. Only one of its
+// requests is with a worker at a time, so answers come back in order; the
+// rest wait in pending.
+struct daemon_client {
+	std::string pending;
+	bool busy = false;
+};
+
+// Hands the client's next complete line to the workers. False once the
+// connection is done with: it asked for a shutdown.
+static bool dispatchLine(int fd, daemon_client& client, BoundedQueue<daemon_request>& requests, bool* stopping)
+{
+	while (!client.busy) {
+		std::string::size_type nl = client.pending.find('\n');
+		if (nl == std::string::npos) return true;
+		std::string line = client.pending.substr(0, nl);
+		client.pending.erase(0, nl + 1);
+		if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+		if (line.empty()) continue;
+
+		if (line == "shutdown") {
+			*stopping = true;
+			sendLine(fd, "ok");
+			return false;
+		}
+		client.busy = true;
+		requests.push(daemon_request{fd, line});
+	}
+	return true;
+}
+
+int runDaemon(const daemon_options& opts)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (opts.socketpath == NULL || strlen(opts.socketpath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is missing or too long.\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, opts.socketpath);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+		return 1;
+	}
+	unlink(opts.socketpath);
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+		fprintf(stderr, "Couldn't listen on %s: %s\n", opts.socketpath, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	int nworkers = opts.workers > 0 ? opts.workers : (int)std::thread::hardware_concurrency();
+	if (nworkers < 1) nworkers = 1;
+
+	// workers write a byte here after each answer, to wake the poll
+	int wake[2];
+	if (pipe(wake) != 0) {
+		fprintf(stderr, "Couldn't create a pipe: %s\n", strerror(errno));
+		close(fd);
+		return 1;
+	}
+	fcntl(wake[0], F_SETFL, O_NONBLOCK);
+
+	daemon_state state(opts.cacheSize);
+	BoundedQueue<daemon_request> requests(nworkers * 4);
+	std::mutex repliesLock;
+	std::vector<daemon_reply> replies;
+
+	std::vector<std::thread> workers;
+	for (int w = 0; w < nworkers; w++) {
+		workers.emplace_back([&]() {
+			daemon_request r;
+			while (requests.pop(r)) {
+				bool sent = sendLine(r.fd, handleRequest(&state, r.line));
+				{
+					std::lock_guard<std::mutex> guard(repliesLock);
+					replies.push_back(daemon_reply{r.fd, sent});
+				}
+				char b = 0;
+				while (write(wake[1], &b, 1) < 0 && errno == EINTR) { }
+			}
+		});
+	}
+
+	// Workers take requests, not connections, so idle clients cost nothing
+	// but a slot in the poll. A connection is read from only while none of
+	// its requests is with a worker, and only closed then too.
+	std::map<int, daemon_client> clients;
+	bool stopping = false;
+	auto hangUp = [&](int client) {
+		close(client);
+		clients.erase(client);
+	};
+	while (!stopping || !clients.empty()) {
+		std::vector<pollfd> fds;
+		fds.push_back(pollfd{wake[0], POLLIN, 0});
+		if (!stopping) fds.push_back(pollfd{fd, POLLIN, 0});
+		for (const auto& c: clients) {
+			if (!c.second.busy) fds.push_back(pollfd{c.first, POLLIN, 0});
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for (const auto& p: fds) {
+			if (p.revents == 0) continue;
+			if (p.fd == wake[0]) {
+				char drain[64];
+				while (read(wake[0], drain, sizeof(drain)) > 0) { }
+				std::vector<daemon_reply> done;
+				{
+					std::lock_guard<std::mutex> guard(repliesLock);
+					done.swap(replies);
+				}
+				for (const auto& r: done) {
+					daemon_client& c = clients[r.fd];
+					c.busy = false;
+					if (!r.sent || !dispatchLine(r.fd, c, requests, &stopping)) hangUp(r.fd);
+				}
+			} else if (p.fd == fd) {
+				int client = accept(fd, NULL, NULL);
+				if (client < 0) {
+					if (errno != EINTR && errno != ECONNABORTED) {
+						fprintf(stderr, "accept failed: %s\n", strerror(errno));
+					}
+					continue;
+				}
+				timeval timeout = { SEND_TIMEOUT, 0 };
+				setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+				clients[client] = daemon_client();
+			} else {
+				auto it = clients.find(p.fd);
+				if (it == clients.end() || it->second.busy) continue;
+				// a hang-up above may have handed this number to a new client
+				// that has nothing to read yet, so don't wait on it
+				char buf[4096];
+				ssize_t n = recv(p.fd, buf, sizeof(buf), MSG_DONTWAIT);
+				if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+				if (n <= 0) {
+					hangUp(p.fd);
+					continue;
+				}
+				it->second.pending.append(buf, n);
+				if (!dispatchLine(p.fd, it->second, requests, &stopping)) hangUp(p.fd);
+			}
+		}
+		if (stopping && fd >= 0) {
+			close(fd); // new connections are refused from here on
+			fd = -1;
+		}
+	}
+
+	requests.close();
+	for (auto& t: workers) t.join();
+	for (const auto& c: clients) close(c.first);
+	close(wake[0]);
+	close(wake[1]);
+	if (fd >= 0) close(fd);
+	unlink(opts.socketpath);
+	return 0;
+}
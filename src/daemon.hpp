@@ -0,0 +1,27 @@
+#ifndef DAEMON_H_INCLUDED
+#define DAEMON_H_INCLUDED
+
+#include <stddef.h>
+
+struct daemon_options {
+	const char* socketpath = NULL;
+	int workers = 0;	// 0 picks one per core
+	int cacheSize = 8;	// parsed maps kept warm
+};
+
+// Serves conversions on a Unix domain socket until a client asks it to shut
+// down. Each request is one line of tab-separated fields:
+//
+//   infile <TAB> outfile.obj <TAB> outfile.mtl [<TAB> option [<TAB> value]]...
+//
+// where the options are the command line's conversion options (--dds,
+// --compress bc7, ...). Paths resolve against the daemon's working directory.
+// Every request is answered with one line: "ok cached", "ok loaded" or
+// "error: <reason>". A connection's requests are answered in order, one at a
+// time; the workers take requests rather than connections, so any number of
+// idle clients can stay connected. A line reading "shutdown" stops accepting
+// connections; the daemon exits once the connected clients hang up. Returns
+// the process exit code.
+int runDaemon(const daemon_options& opts);
+
+#endif
@@ -0,0 +1,163 @@
+#include "dds.hpp"
+#include <stdio.h>
+#include <string.h>
+
+#define DDSD_CAPS			0x1
+#define DDSD_HEIGHT			0x2
+#define DDSD_WIDTH			0x4
+#define DDSD_PITCH			0x8
+#define DDSD_PIXELFORMAT	0x1000
+#define DDSD_MIPMAPCOUNT	0x20000
+#define DDSD_LINEARSIZE		0x80000
+
+#define DDPF_ALPHAPIXELS	0x1
+#define DDPF_FOURCC			0x4
+#define DDPF_RGB			0x40
+
+#define DDSCAPS_COMPLEX		0x8
+#define DDSCAPS_TEXTURE		0x1000
+#define DDSCAPS_MIPMAP		0x400000
+
+#define MAKEFOURCC(a, b, c, d) ((unsigned int)(a) | ((unsigned int)(b) << 8) | ((unsigned int)(c) << 16) | ((unsigned int)(d) << 24))
+
+#define DXGI_FORMAT_BC7_UNORM			98
+#define D3D10_RESOURCE_DIMENSION_2D		3
+
+struct dds_pixelformat_t {
+	unsigned int size;
+	unsigned int flags;
+	unsigned int fourCC;
+	unsigned int rgbBitCount;
+	unsigned int rBitMask, gBitMask, bBitMask, aBitMask;
+};
+
+struct dds_header_t {
+	unsigned int size;
+	unsigned int flags;
+	unsigned int height;
+	unsigned int width;
+	unsigned int pitchOrLinearSize;
+	unsigned int depth;
+	unsigned int mipMapCount;
+	unsigned int reserved1[11];
+	dds_pixelformat_t ddspf;
+	unsigned int caps, caps2, caps3, caps4;
+	unsigned int reserved2;
+};
+
+struct dds_header_dx10_t {
+	unsigned int dxgiFormat;
+	unsigned int resourceDimension;
+	unsigned int miscFlag;
+	unsigned int arraySize;
+	unsigned int miscFlags2;
+};
+
+void extendMipChain(std::vector<mip_level>& levels)
+{
+	if (levels.empty()) return;
+
+	while (levels.back().w > 1 || levels.back().h > 1) {
+		const mip_level& src = levels.back();
+		mip_level dst;
+		dst.w = src.w > 1 ? src.w / 2 : 1;
+		dst.h = src.h > 1 ? src.h / 2 : 1;
+		dst.rgba.resize(dst.w * dst.h * 4);
+
+		// 2x2 box filter; an axis that's already 1 texel wide samples once
+		int sx = src.w > 1 ? 1 : 0;
+		int sy = src.h > 1 ? 1 : 0;
+		for (int y = 0; y < dst.h; y++) {
+			const unsigned char* row0 = &src.rgba[(y * 2) * src.w * 4];
+			const unsigned char* row1 = &src.rgba[(y * 2 + sy) * src.w * 4];
+			unsigned char* out = &dst.rgba[y * dst.w * 4];
+			for (int x = 0; x < dst.w; x++) {
+				int a = x * 2 * 4, b = (x * 2 + sx) * 4;
+				for (int c = 0; c < 4; c++) {
+					out[x * 4 + c] = (unsigned char)((row0[a + c] + row0[b + c] + row1[a + c] + row1[b + c] + 2) / 4);
+				}
+			}
+		}
+
+		levels.push_back(std::move(dst));
+	}
+}
+
+static void initHeader(dds_header_t* hdr, const std::vector<mip_level>& levels)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->size = sizeof(dds_header_t);
+	hdr->flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT;
+	hdr->height = levels[0].h;
+	hdr->width = levels[0].w;
+	hdr->mipMapCount = levels.size();
+	hdr->ddspf.size = sizeof(dds_pixelformat_t);
+	hdr->caps = DDSCAPS_TEXTURE | DDSCAPS_MIPMAP | DDSCAPS_COMPLEX;
+}
+
+static bool writeFile(FILE* fp, const dds_header_t& hdr, const dds_header_dx10_t* dx10,
+	const std::vector<const std::vector<unsigned char>*>& payloads)
+{
+	bool ok = fwrite("DDS ", 1, 4, fp) == 4;
+	ok = ok && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	if (dx10 != NULL) ok = ok && fwrite(dx10, sizeof(*dx10), 1, fp) == 1;
+	for (size_t i = 0; ok && i < payloads.size(); i++) {
+		ok = fwrite(payloads[i]->data(), 1, payloads[i]->size(), fp) == payloads[i]->size();
+	}
+	return ok;
+}
+
+bool writeDDS(FILE* fp, const std::vector<mip_level>& levels)
+{
+	if (levels.empty()) return false;
+
+	dds_header_t hdr;
+	initHeader(&hdr, levels);
+	hdr.flags |= DDSD_PITCH;
+	hdr.pitchOrLinearSize = levels[0].w * 4;
+	hdr.ddspf.flags = DDPF_RGB | DDPF_ALPHAPIXELS;
+	hdr.ddspf.rgbBitCount = 32;
+	hdr.ddspf.rBitMask = 0x000000ff;
+	hdr.ddspf.gBitMask = 0x0000ff00;
+	hdr.ddspf.bBitMask = 0x00ff0000;
+	hdr.ddspf.aBitMask = 0xff000000;
+
+	std::vector<const std::vector<unsigned char>*> payloads;
+	for (size_t i = 0; i < levels.size(); i++) payloads.push_back(&levels[i].rgba);
+	return writeFile(fp, hdr, NULL, payloads);
+}
+
+bool writeDDS(FILE* fp, const std::vector<mip_level>& levels,
+	const BlockFormat fmt, const BlockQuality quality)
+{
+	if (levels.empty()) return false;
+
+	dds_header_t hdr;
+	initHeader(&hdr, levels);
+	hdr.flags |= DDSD_LINEARSIZE;
+	hdr.pitchOrLinearSize = blockCompressedSize(fmt, levels[0].w, levels[0].h);
+	hdr.ddspf.flags = DDPF_FOURCC;
+
+	dds_header_dx10_t dx10;
+	memset(&dx10, 0, sizeof(dx10));
+	switch (fmt) {
+		case BlockFormat::BC1: hdr.ddspf.fourCC = MAKEFOURCC('D', 'X', 'T', '1'); break;
+		case BlockFormat::BC3: hdr.ddspf.fourCC = MAKEFOURCC('D', 'X', 'T', '5'); break;
+		case BlockFormat::BC7:
+			// no FourCC of its own; readers take the format from the DX10 header
+			hdr.ddspf.fourCC = MAKEFOURCC('D', 'X', '1', '0');
+			dx10.dxgiFormat = DXGI_FORMAT_BC7_UNORM;
+			dx10.resourceDimension = D3D10_RESOURCE_DIMENSION_2D;
+			dx10.arraySize = 1;
+			break;
+	}
+
+	std::vector<std::vector<unsigned char>> blocks(levels.size());
+	std::vector<const std::vector<unsigned char>*> payloads;
+	for (size_t i = 0; i < levels.size(); i++) {
+		blocks[i].resize(blockCompressedSize(fmt, levels[i].w, levels[i].h));
+		compressBlocks(levels[i].rgba.data(), levels[i].w, levels[i].h, fmt, quality, blocks[i].data());
+		payloads.push_back(&blocks[i]);
+	}
+	return writeFile(fp, hdr, fmt == BlockFormat::BC7 ? &dx10 : NULL, payloads);
+}
@@ -0,0 +1,26 @@
+#ifndef DDS_H_INCLUDED
+#define DDS_H_INCLUDED
+
+#include <stdio.h>
+#include <vector>
+#include "bcenc.hpp"
+
+// One RGBA8 mip level.
+struct mip_level {
+	int w, h;
+	std::vector<unsigned char> rgba;
+};
+
+// Box-filters the smallest level of the chain down to 1x1, appending each
+// new level. Levels already present (e.g. the four a miptex carries) are kept.
+void extendMipChain(std::vector<mip_level>& levels);
+
+// Writes the chain, largest level first, as an uncompressed RGBA8 DDS.
+bool writeDDS(FILE* fp, const std::vector<mip_level>& levels);
+
+// Block-compresses every level and writes the chain as DXT1 (BC1), DXT5 (BC3)
+// or, behind a DX10 extension header, BC7.
+bool writeDDS(FILE* fp, const std::vector<mip_level>& levels,
+	const BlockFormat fmt, const BlockQuality quality);
+
+#endif
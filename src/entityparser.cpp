@@ -3,7 +3,7 @@
 EntityParser::EntityParser(const char* filecontents) {
 	size_t len = strlen(filecontents);
 	data = new char[len+1];
-	strncpy(data, filecontents, len);
+	memcpy(data, filecontents, len);
 	data[len] = 0;
 	cursor = data;
 	parse();
@@ -38,7 +38,7 @@ void EntityParser::consumeString(char* dest, int maxlen) {
 	consume('"');
 
 	int c = 0;
-	while (*cursor != '"' && c < maxlen-1) {
+	while (*cursor != 0 && *cursor != '"' && c < maxlen-1) {
 		dest[c++] = *cursor;
 		cursor++;
 	}
@@ -129,7 +129,7 @@ void EntityParser::consumeTexture(char* name) {
 	consumeWhitespace();
 
 	int c = 0;
-	while (*cursor != ' ' && *cursor != '\t' && c < TEXTURE_NAME_MAX_LEN-1) {
+	while (*cursor != 0 && *cursor != ' ' && *cursor != '\t' && c < TEXTURE_NAME_MAX_LEN-1) {
 		name[c++] = *cursor;
 		cursor++;
 	}
@@ -137,7 +137,10 @@ void EntityParser::consumeTexture(char* name) {
 }
 
 int EntityParser::consumeInteger() {
-	return (int)consumeFloat();
+	float f = consumeFloat();
+	if (!(f > -2147483520.0f)) return f < 0 ? -2147483647 - 1 : 0; // and NaN
+	if (f > 2147483520.0f) return 2147483647;
+	return (int)f;
 }
 
 bool EntityParser::numeric(char t) {
@@ -184,7 +187,7 @@ void EntityParser::consumeFace(ent_brush_t *brush) {
 ent_brush_t* EntityParser::consumeBrush() {
 	ent_brush_t* brush = new ent_brush_t;
 	consume('{');
-	while (!match('}')) {
+	while (!match('}') && *cursor != 0) {
 		consumeFace(brush);
 		consumeWhitespace();
 	}
@@ -209,6 +212,10 @@ bool EntityParser::consumeEntity(quake_entity_t *e) {
 		} else if (match('}')) {
 			consume('}');
 			return true;
+		} else if (*cursor == 0) {
+			return false; // unterminated
+		} else {
+			cursor++; // stray character
 		}
 	}
 }
@@ -2,6 +2,7 @@
 #define ENTITYPARSER_H_INCLUDED
 
 #include <stdio.h>
+#include <string.h>
 #include <vector>
 #include <map>
 #include <regex>
@@ -264,6 +264,25 @@ static pixel defaultPalette[256] = {
 	{159, 	91, 	83, 255}
 };
 
+const char* textureExtension(TextureFormat fmt) {
+	return fmt == TextureFormat::DDS ? "dds" : "tga";
+}
+
+void expandPalette(const unsigned char* indices, const int count, unsigned char* rgba, const bool keyed) {
+	for (int i = 0; i < count; i++) {
+		int ofs = i * 4;
+		if (keyed && indices[i] == 255) {
+			rgba[ofs] = rgba[ofs+1] = rgba[ofs+2] = rgba[ofs+3] = 0;
+			continue;
+		}
+		auto p = defaultPalette[indices[i]];
+		rgba[ofs] = (unsigned char)p.r;
+		rgba[ofs+1] = (unsigned char)p.g;
+		rgba[ofs+2] = (unsigned char)p.b;
+		rgba[ofs+3] = (unsigned char)p.a;
+	}
+}
+
 ImageBuffer::ImageBuffer(const int w, const int h, const unsigned char* data): imgw(w), imgh(h) {
 	size_t bytelen = w * h * 4;
 	buffer = (unsigned char*)malloc(bytelen * sizeof(unsigned char));
@@ -271,28 +290,22 @@ ImageBuffer::ImageBuffer(const int w, const int h, const unsigned char* data): i
 		fprintf(stderr, "Couldn't allocate buffer of %lu bytes.\n", bytelen);
 		return;
 	}
-	for (int i = 0; i < w * h; i++) {
-		int ofs = i * 4;
-		auto p = defaultPalette[data[i]];
-		buffer[ofs] = (unsigned char)p.r;
-		buffer[ofs+1] = (unsigned char)p.g;
-		buffer[ofs+2] = (unsigned char)p.b;
-		buffer[ofs+3] = (unsigned char)p.a;
-	}
+	expandPalette(data, w * h, buffer);
 }
 
 ImageBuffer::~ImageBuffer() {
 	if (buffer) free(buffer);
 }
 
-void ImageBuffer::write(std::string filename) {
+static void writeToFile(void* context, void* data, int size) {
+	fwrite(data, 1, size, (FILE*)context);
+}
+
+bool ImageBuffer::write(FILE* fp) {
 	if (buffer == nullptr) {
 		fprintf(stderr, "Attempted to write unallocated buffer.\n");
-		return;
-	}
-	//stbi_write_png(filename.c_str(), imgw, imgh, 4, (void*)buffer, 0);
-	int result = stbi_write_tga(filename.c_str(), imgw, imgh, 4, (void*)buffer);
-	if (result == 0) {
-		fprintf(stderr, "Couldn't write file: %s\n", filename.c_str());
+		return false;
 	}
+	//stbi_write_png_to_func(writeToFile, fp, imgw, imgh, 4, (void*)buffer, 0);
+	return stbi_write_tga_to_func(writeToFile, fp, imgw, imgh, 4, (void*)buffer) != 0 && ferror(fp) == 0;
 }
@@ -1,19 +1,31 @@
 #ifndef IMAGEBUFFER_H_INCLUDED
 #define IMAGEBUFFER_H_INCLUDED
 
+#include <stdio.h>
 #include <string>
 
 struct pixel {
 	int r, g, b, a;
 };
 
+enum class TextureFormat {
+	TGA,	// level 0 only
+	DDS		// RGBA8 with the full mip chain
+};
+
+const char* textureExtension(TextureFormat fmt);
+
+// Converts count palette indices to RGBA8 through the Quake palette. keyed
+// maps index 255 to transparent black, as '{' textures expect.
+void expandPalette(const unsigned char* indices, const int count, unsigned char* rgba, const bool keyed = false);
+
 class ImageBuffer {
 	unsigned char* buffer = nullptr;
 	int imgw, imgh;
 public:
 	ImageBuffer(const int w, const int h, const unsigned char* data);
 	~ImageBuffer();
-	void write(std::string filename);
+	bool write(FILE* fp);
 };
 
 #endif
@@ -0,0 +1,91 @@
+#ifndef LIBBSP2OBJ_H_INCLUDED
+#define LIBBSP2OBJ_H_INCLUDED
+
+/*
+ * C interface to the converter, for linking it into other tools instead of
+ * running bsp2obj and parsing its OBJ output. Everything handed back is
+ * copied into memory the caller owns; handles are freed with their matching
+ * bsp2obj_free_* call. Buffer sizes are passed as element counts (floats,
+ * indices, structs or bytes). Functions returning int give 0 on success and
+ * -1 on failure: a bad handle, an index out of range or a buffer too small.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define BSP2OBJ_API __attribute__((visibility("default")))
+#else
+#define BSP2OBJ_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BSP2OBJ_API_VERSION 1
+
+typedef struct bsp2obj_map bsp2obj_map;
+typedef struct bsp2obj_mesh bsp2obj_mesh;
+
+typedef struct {
+	int center;		/* move the bounding box center to the origin */
+	float scale;	/* uniform scale applied after centering */
+	int yup;		/* rotate Quake's z-up into y-up */
+} bsp2obj_mesh_options;
+
+typedef struct {
+	uint32_t vertices;	/* positions, texcoords and normals all have this many */
+	uint32_t indices;	/* three per triangle, grouped by material */
+	uint32_t materials;
+} bsp2obj_mesh_info;
+
+typedef struct {
+	char name[17];
+	int32_t texture;		/* index for bsp2obj_texture_info and bsp2obj_decode_texture */
+	uint32_t firstIndex;	/* this material's triangles, within the index array */
+	uint32_t numIndices;
+} bsp2obj_material;
+
+typedef struct {
+	char name[17];
+	uint32_t width, height;	/* of level 0 */
+	uint32_t levels;		/* stored mip levels */
+} bsp2obj_texture;
+
+BSP2OBJ_API int bsp2obj_api_version(void);
+
+/* Loads a BSP29, BSP2 or 2PSB map. NULL if it can't be read or parsed. */
+BSP2OBJ_API bsp2obj_map* bsp2obj_load_file(const char* path);
+/* The buffer is copied during the call and can be released after. */
+BSP2OBJ_API bsp2obj_map* bsp2obj_load_memory(const void* data, size_t size);
+BSP2OBJ_API void bsp2obj_free_map(bsp2obj_map* map);
+
+/* Defaults match the bsp2obj command line: centered, scaled by 0.1, y-up. */
+BSP2OBJ_API void bsp2obj_default_mesh_options(bsp2obj_mesh_options* opts);
+/* opts may be NULL for the defaults. The mesh doesn't reference the map. */
+BSP2OBJ_API bsp2obj_mesh* bsp2obj_build_mesh(const bsp2obj_map* map, const bsp2obj_mesh_options* opts);
+BSP2OBJ_API void bsp2obj_free_mesh(bsp2obj_mesh* mesh);
+
+BSP2OBJ_API int bsp2obj_mesh_get_info(const bsp2obj_mesh* mesh, bsp2obj_mesh_info* info);
+/* xyz needs 3 * info.vertices floats */
+BSP2OBJ_API int bsp2obj_mesh_copy_positions(const bsp2obj_mesh* mesh, float* xyz, size_t count);
+/* uv needs 2 * info.vertices floats */
+BSP2OBJ_API int bsp2obj_mesh_copy_texcoords(const bsp2obj_mesh* mesh, float* uv, size_t count);
+/* xyz needs 3 * info.vertices floats; unit length, one per vertex */
+BSP2OBJ_API int bsp2obj_mesh_copy_normals(const bsp2obj_mesh* mesh, float* xyz, size_t count);
+BSP2OBJ_API int bsp2obj_mesh_copy_indices(const bsp2obj_mesh* mesh, uint32_t* indices, size_t count);
+BSP2OBJ_API int bsp2obj_mesh_copy_materials(const bsp2obj_mesh* mesh, bsp2obj_material* materials, size_t count);
+
+BSP2OBJ_API int bsp2obj_texture_count(const bsp2obj_map* map);
+BSP2OBJ_API int bsp2obj_texture_info(const bsp2obj_map* map, int texture, bsp2obj_texture* info);
+/* Expands one stored mip level to RGBA8 (4 * w * h bytes, w and h halving per
+ * level). keyed maps palette index 255 to transparent, as '{' textures use. */
+BSP2OBJ_API int bsp2obj_decode_texture(const bsp2obj_map* map, int texture, int level, int keyed,
+	unsigned char* rgba, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
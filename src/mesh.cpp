@@ -1,59 +1,40 @@
 #include "mesh.hpp"
 #include "common.h"
+#include "chunkwriter.hpp"
+#include <assert.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <unordered_map>
 
-Mesh::Mesh() {
-	textures = (char**)malloc(maxTextures * sizeof(char*));
-	memset(textures, 0, sizeof(char*) * maxTextures);
-	assert(textures != NULL);
-	for (int t = 0; t < maxTextures; t++) {
-		textures[t] = NULL;
-		textures[t] = (char*)malloc(MAX_TEXTURE_NAME_LENGTH * sizeof(char));
-		assert(textures[t] != NULL);
-		// TODO: better than assert since it doesn't get compiled into production
-	}
-}
+Mesh::Mesh() { }
 
-Mesh::~Mesh() {
-	if (textures != NULL) {
-		for (int i = 0; i < maxTextures; i++) {
-			if (textures[i] != NULL) free(textures[i]);
-		}
-		free(textures);
-	}
-}
+Mesh::~Mesh() { }
 
 Mesh::Mesh(Mesh&& other) {
-	vertices = std::vector<mesh_v3>(std::move(other.vertices));
-	normals = std::vector<mesh_v3>(std::move(other.normals));
+	vertices = std::move(other.vertices);
+	normals = std::move(other.normals);
 	texcoords = std::vector<mesh_v2>(std::move(other.texcoords));
 	materials = std::vector<mesh_mat>(std::move(other.materials));
 	lights = std::vector<mesh_light>(std::move(other.lights));
-	faces = std::vector<mesh_face>(std::move(other.faces));
-	miptex_to_texidx = std::map<int, int>(std::move(other.miptex_to_texidx));
-
-	// NOTE: changing to this from a vector<string> was completely unnecessary but
-	// i like this style more anyway so eff it, it stays.
-	nTextures = other.nTextures; other.nTextures = 0;
-	maxTextures = other.maxTextures; other.maxTextures = MESH_DEFAULT_MAX_TEXTURES;
-	textures = other.textures; other.textures = NULL;
+	colors = std::vector<mesh_v3>(std::move(other.colors));
+	groups = std::vector<mesh_facegroup>(std::move(other.groups));
+	ranges = std::vector<mesh_matrange>(std::move(other.ranges));
+	objects = std::vector<mesh_object>(std::move(other.objects));
+	indices = std::move(other.indices);
+	miptex_to_mat = std::vector<int>(std::move(other.miptex_to_mat));
+	plane_to_normal = std::vector<int>(std::move(other.plane_to_normal));
+	diagnostics = std::move(other.diagnostics);
 }
 
-static mesh_v2 translate_texcoords(const mesh_v3* vtx, const texinfo_t* tinfo, const miptex_t* tex) {
-	// dot product of the texture's basis plus its offset
-	return mesh_v2 {
-		(f32)((vtx->x * tinfo->vecs[0][0]) + (vtx->y * tinfo->vecs[0][1]) + (vtx->z * tinfo->vecs[0][2]) + (f32)tinfo->vecs[0][3]) / (f32)tex->width,
-		-(f32)((vtx->x * tinfo->vecs[1][0]) + (vtx->y * tinfo->vecs[1][1]) + (vtx->z * tinfo->vecs[1][2]) + (f32)tinfo->vecs[1][3]) / (f32)tex->height
-	};
+void IndexStream::widen() {
+	wide.reserve(narrow.capacity());
+	wide.assign(narrow.begin(), narrow.end());
+	std::vector<u16>().swap(narrow);
+	is_wide = true;
 }
 
-struct error_all_points_same{ };
-struct error_all_points_colinear{ };
-struct error_normal_is_zero{int A,B,C;mesh_v3 n,Nn;};
-struct error_normal_is_invalid{int A,B,C;mesh_v3 n,Nn;};
-
 f32 dot(const mesh_v3& A, const mesh_v3& B) {
 	return A.x * B.x + A.y * B.y + A.z * B.z;
 }
@@ -69,151 +50,360 @@ bool colinear(const mesh_v3& A, const mesh_v3& B, const mesh_v3& C) {
 	return fleq(len(AB) + len(BC), len(AC));
 }
 
-static mesh_v3 getFaceNormal(const std::vector<dvertex_t> &vertices) {
+static f32 sqlen(const mesh_v3& v) {
+	return v.x * v.x + v.y * v.y + v.z * v.z;
+}
+
+// Degenerate-face test. Works on squared lengths so there are no sqrtf calls,
+// and reports through its return value so a bad face costs next to nothing.
+static FaceStatus checkFace(const dvertex_t* points, const int* idx, const int n) {
 	// rules:
 	// A is first point
 	// B cannot be equal-ish to A
 	// C cannot be colinear to A and B
-	assert(vertices.size() > 2);
-	mesh_v3 n;
-
-	int iB, iC;
-	mesh_v3 A, B, C;
-	A = vertices[0];
-	iB = 1;
-	while(A.equiv(vertices[iB], 0.001f) && iB < (int)vertices.size()) iB++;
-	if (iB >= (int)vertices.size()) throw error_all_points_same{};
-	B =  vertices[iB];
-	iC = iB + 1;
-	while(iC < (int)vertices.size() && colinear(A, B, vertices[iC])) iC++;
-	if (iC >= (int)vertices.size()) throw error_all_points_colinear{};
-	C = vertices[iC];
-
-	n = -cross(B-A, C-A);
-	mesh_v3 out = n;
-	out.normalize();
-	if (!n.nonZero()) throw error_normal_is_zero{0,iB,iC,n,out};
-	if (!n.valid()) throw error_normal_is_invalid{0,iB,iC,n,out};
-	return out;
-}
-
-static void pushBSPFace(const bspdata* bsp, const int faceid, const mesh_v3 origin, Mesh& mesh) {
-	texinfo_t tinfo = bsp->texInfos[bsp->faces[faceid].texinfo]; // fetch texture info
-	// if (tinfo.miptex == 7) continue; // gtfo sky
-
-	std::vector<dvertex_t> verts = bsp->getFaceVertices(faceid);
-	assert(verts.size() > 2);
+	if (n < 3) return FaceStatus::TooFewPoints;
+	auto vertices = [points, idx](int i) { return mesh_v3(points[idx[i]]); };
 
-	int texidx = mesh.texLookup(tinfo.miptex);
-	if (texidx < 0) {
-		texidx = mesh.texInsert(tinfo.miptex, &bsp->miptexList[tinfo.miptex]);
+	for (int i = 0; i < n; i++) {
+		if (!vertices(i).valid()) return FaceStatus::InvalidPoint;
 	}
 
-	// calculate surface normal & push one normal to be used for each vertex on this face
-	std::vector<int> points;
-	std::vector<int> tcs;
-	for (size_t i = 0; i < verts.size(); i++) {
-		mesh_v3 v = {verts[i].point[0], verts[i].point[1], verts[i].point[2]};
-		points.push_back(mesh.vertices.size());
-		mesh.vertices.push_back(v);
-		tcs.push_back(mesh.texcoords.size());
-		mesh.texcoords.push_back(translate_texcoords(&v, &tinfo, &bsp->miptexList[tinfo.miptex]));
+	mesh_v3 A = vertices(0);
+	int iB = 1;
+	while (iB < n && sqlen(vertices(iB) - A) < 0.001f * 0.001f) iB++;
+	if (iB >= n) return FaceStatus::AllPointsSame;
+
+	// colinear when the sine of the angle at A is below ~1e-4
+	mesh_v3 AB = vertices(iB) - A;
+	f32 ab2 = sqlen(AB);
+	for (int iC = iB + 1; iC < n; iC++) {
+		mesh_v3 AC = vertices(iC) - A;
+		if (sqlen(cross(AB, AC)) > 1e-8f * ab2 * sqlen(AC)) return FaceStatus::Ok;
 	}
+	return FaceStatus::AllPointsColinear;
+}
 
-	mesh_v3 normal;
-	try {
-		normal = getFaceNormal(verts);
-	} catch (error_all_points_same e) {
-		fprintf(stderr, "Face #%i's vertices are all the same.\n", faceid);
-		for (auto v : verts) fprintf(stderr, "  {%f, %f, %f}\n", v.point[0], v.point[1], v.point[2]);
-		return;
-	} catch (error_all_points_colinear e) {
-		fprintf(stderr, "Face #%i's vertices are all colinear.\n", faceid);
-		for (auto v : verts) fprintf(stderr, "  {%f, %f, %f}\n", v.point[0], v.point[1], v.point[2]);
-		return;
-	} catch (error_normal_is_zero e) {
-		fprintf(stderr, "Face #%i's normal is zero.\n", faceid);
-		for (auto v : verts) fprintf(stderr, "  {%f, %f, %f}\n", v.point[0], v.point[1], v.point[2]);
-		fprintf(stderr, "  Selected indices: A=%i, B=%i, C=%i\n", e.A,e.B,e.C);
-		fprintf(stderr, "  calculated normal: {%f, %f, %f}\n", e.n.x, e.n.y, e.n.z);
-		fprintf(stderr, "  normalized: {%f, %f, %f}\n", e.Nn.x, e.Nn.y, e.Nn.z);
-		return;
-	} catch (error_normal_is_invalid e) {
-		fprintf(stderr, "Face #%i's normal is invalid.\n", faceid);
-		for (auto v : verts) fprintf(stderr, "  {%f, %f, %f}\n", v.point[0], v.point[1], v.point[2]);
-		fprintf(stderr, "  Selected indices: A=%i, B=%i, C=%i\n", e.A,e.B,e.C);
-		fprintf(stderr, "  calculated normal: {%f, %f, %f}\n", e.n.x, e.n.y, e.n.z);
-		fprintf(stderr, "  normalized: {%f, %f, %f}\n", e.Nn.x, e.Nn.y, e.Nn.z);
+// scratch holds the face's resolved vertex indices; it's sized once for the
+// largest face so nothing here touches the heap
+static void pushBSPFace(const bspdata* bsp, const int faceid, const mesh_v3 origin, Mesh& mesh, int* scratch, int maxverts) {
+	// each lump checks its indices as it's first read, so every one a face
+	// leads to is already valid and none are checked again here
+	const int nverts = bsp->getFaceVertexIndices(faceid, scratch, maxverts);
+	FaceStatus status = checkFace(bsp->vertices, scratch, nverts);
+	if (status != FaceStatus::Ok) {
+		mesh.diagnostics.record(faceid, status);
 		return;
 	}
 
-	int normal_idx = mesh.normals.size();
-	mesh.normals.push_back(normal);
+	// only now, since a face the load found broken keeps no edges
+	const texinfo_t& tinfo = bsp->texInfos[bsp->faces[faceid].texinfo]; // fetch texture info
 
-	for (auto p : points) mesh.vertices[p] += origin;
+	int texidx = mesh.texLookup(tinfo.miptex);
+	if (texidx < 0) {
+		texidx = mesh.texInsert(tinfo.miptex, &bsp->miptexList[tinfo.miptex]);
+	}
 
-	int maxV = verts.size() - 1;
+	// push the face's vertices, then derive their texcoords in one pass;
+	// vertex i always pairs with texcoord i
+	u32 first = mesh.vertices.size();
+	for (int i = 0; i < nverts; i++) {
+		mesh.vertices.push_back(bsp->vertices[scratch[i]]);
+	}
+	const miptex_t* tex = &bsp->miptexList[tinfo.miptex];
+	mesh.texcoords.resize(first + nverts);
+	mesh.vertices.generateUVs(first, nverts, tinfo.vecs,
+		(f32)tex->width, (f32)tex->height, &mesh.texcoords[first]);
+
+	// one normal per distinct plane/side, shared by every face on it
+	const dface2_t* face = &bsp->faces[faceid];
+	int normal_idx = mesh.normalLookup(face->planenum, face->side);
+	if (normal_idx < 0) {
+		normal_idx = mesh.normalInsert(face->planenum, face->side, &bsp->planes[face->planenum]);
+	}
+
+	mesh.vertices.translate(origin, first, nverts);
+
+	int maxV = nverts - 1;
+	mesh.groups.push_back(mesh_facegroup{
+		(u32)mesh.indices.size(), (u32)(maxV - 1), (u32)texidx, (u32)normal_idx
+	});
 	for (int v = 1; v < maxV; v++) {
-		mesh.faces.push_back(mesh_face{
-			{points[0], points[v+1], points[v]},
-			{tcs[0], tcs[v+1], tcs[v]},
-			{normal_idx, normal_idx, normal_idx},
-			texidx
-		});
+		mesh.indices.push_back(first);
+		mesh.indices.push_back(first + v + 1);
+		mesh.indices.push_back(first + v);
 
 		if (mesh.debug) {
+			mesh_v3 A = mesh.vertices[first], B = mesh.vertices[first + v + 1], C = mesh.vertices[first + v];
 			printf("face added with points:\n  A: %f %f %f\n  B: %f %f %f\n  C: %f %f %f\n\n",
-				mesh.vertices[points[0]].x, mesh.vertices[points[0]].y, mesh.vertices[points[0]].z,
-				mesh.vertices[points[v+1]].x, mesh.vertices[points[v+1]].y, mesh.vertices[points[v+1]].z,
-				mesh.vertices[points[v]].x, mesh.vertices[points[v]].y, mesh.vertices[points[v]].z
+				A.x, A.y, A.z, B.x, B.y, B.z, C.x, C.y, C.z
 			);
 		}
 	} // triangles
 }
 
-static void pushBSPModel(const bspdata* bsp, int m, Mesh& mesh, std::vector<bool>& faceflags) {
-	f32 *origin = bsp->models[m].origin;
+// the texinfos a filter drops, classified once per texinfo rather than once
+// per face; empty when every surface is kept
+static std::vector<bool> skippedTexInfos(const bspdata* bsp, const surface_filter& filter) {
+	std::vector<bool> skip;
+	if (!filter.keepsAll()) {
+		skip.resize(bsp->numTexInfos);
+		for (int t = 0; t < bsp->numTexInfos; t++) skip[t] = !filter.keep[(int)bsp->getSurfaceClass(t)];
+	}
+	return skip;
+}
+
+// calls fn with each face of model m that no earlier model took and skip keeps
+template<typename F>
+static void forEachModelFace(const bspdata* bsp, int m, std::vector<bool>& faceflags, const std::vector<bool>& skip,
+	F fn) {
+	const dface2_t *faces = bsp->faces;
 	for (int i = 0; i < bsp->models[m].numfaces; i++) {
 		int f = bsp->models[m].firstface + i;
 
 		if (faceflags[f]) continue;
 		faceflags[f] = true;
+		if (!skip.empty() && skip[faces[f].texinfo]) continue;
+
+		fn(f);
+	}
+}
+
+static void pushBSPModel(const bspdata* bsp, int m, Mesh& mesh, std::vector<bool>& faceflags, std::vector<int>& scratch,
+	const std::vector<bool>& skip) {
+	f32 *origin = bsp->models[m].origin;
+	mesh_v3 model_origin = { origin[0], origin[1], origin[2] };
+	forEachModelFace(bsp, m, faceflags, skip, [&](int f) {
+		pushBSPFace(bsp, f, model_origin, mesh, scratch.data(), scratch.size());
+	});
+}
+
+// a light entity's position and level, when it has an origin
+static void pushLight(const quake_entity_t& e, Mesh& mesh) {
+	const ent_property_t *o = e.getProperty("origin");
+	if (o != NULL && o->type == PropertyType::Vector) {
+		const ent_property_t *p = e.getProperty("light");
+		int intensity = (p == NULL) ? 200 : p->number_value;
+		mesh.lights.push_back({
+			o->vector_value[0], o->vector_value[1], o->vector_value[2], (f32)intensity
+		});
+	}
+}
+
+// Where each model's geometry starts, and the signatures of the models kept
+// so far, for spotting repeats.
+struct object_builder {
+	size_t groups, vertices, indices, normals;
+	std::unordered_multimap<unsigned long long, int> byHash; // signature hash to object
+	std::vector<std::vector<int>> signatures; // per object; empty for instances
+};
+
+// The geometry from firstGroup on, relative to ref and quantized, so two
+// models with equal signatures are the same shape moved by a translation.
+// Texcoords only have to agree up to whole repeats of the texture.
+static std::vector<int> modelSignature(const Mesh& mesh, size_t firstGroup, const mesh_v3& ref) {
+	std::vector<int> sig;
+	for (size_t g = firstGroup; g < mesh.groups.size(); g++) {
+		const mesh_facegroup& fg = mesh.groups[g];
+		mesh_v3 n = mesh.normals[fg.normal];
+		sig.push_back(mesh.materials[fg.material].miptex);
+		sig.push_back(fg.numTris);
+		sig.push_back((int)lrintf(n.x * 1024));
+		sig.push_back((int)lrintf(n.y * 1024));
+		sig.push_back((int)lrintf(n.z * 1024));
+
+		// a face's vertices are contiguous, starting at its fan's hub
+		u32 first = mesh.indices[fg.firstIndex];
+		f32 su = floorf(mesh.texcoords[first].x), sv = floorf(mesh.texcoords[first].y);
+		for (u32 v = first; v < first + fg.numTris + 2; v++) {
+			mesh_v3 p = mesh.vertices[v] - ref;
+			sig.push_back((int)lrintf(p.x * 32));
+			sig.push_back((int)lrintf(p.y * 32));
+			sig.push_back((int)lrintf(p.z * 32));
+			sig.push_back((int)lrintf((mesh.texcoords[v].x - su) * 1024));
+			sig.push_back((int)lrintf((mesh.texcoords[v].y - sv) * 1024));
+		}
+	}
+	return sig;
+}
+
+static unsigned long long hashSignature(const std::vector<int>& sig) {
+	unsigned long long h = 14695981039346656037ULL; // FNV-1a
+	for (int v: sig) {
+		for (int b = 0; b < 4; b++) {
+			h ^= (v >> (b * 8)) & 0xFF;
+			h *= 1099511628211ULL;
+		}
+	}
+	return h;
+}
 
-		mesh_v3 model_origin = { origin[0], origin[1], origin[2] };
-		pushBSPFace(bsp, f, model_origin, mesh);
+// Makes the geometry pushed since the builder's marks into an object for
+// model m, or, if it repeats an earlier object, drops it again and records
+// an instance of that object.
+static void finishObject(const bspdata* bsp, int m, const char* name, Mesh& mesh, object_builder& ob) {
+	if (mesh.groups.size() == ob.groups) return; // nothing of it survived the filters
+
+	const dmodel_t& model = bsp->models[m];
+	mesh_object obj;
+	snprintf(obj.name, sizeof(obj.name), "%s", name);
+	obj.model = m;
+	obj.firstGroup = ob.groups;
+	obj.numGroups = mesh.groups.size() - ob.groups;
+	obj.firstRange = obj.numRanges = 0;
+	obj.mins = mesh_v3{ model.mins[0] + model.origin[0], model.mins[1] + model.origin[1], model.mins[2] + model.origin[2] };
+	obj.maxs = mesh_v3{ model.maxs[0] + model.origin[0], model.maxs[1] + model.origin[1], model.maxs[2] + model.origin[2] };
+	obj.instanceOf = -1;
+
+	std::vector<int> sig = modelSignature(mesh, ob.groups, obj.mins);
+	unsigned long long hash = hashSignature(sig);
+	auto found = ob.byHash.equal_range(hash);
+	for (auto it = found.first; it != found.second; ++it) {
+		if (ob.signatures[it->second] != sig) continue;
+		const mesh_object& proto = mesh.objects[it->second];
+		obj.instanceOf = it->second;
+		obj.offset = obj.mins - proto.mins;
+		obj.firstGroup = obj.numGroups = 0;
+		mesh.truncate(ob.groups, ob.vertices, ob.indices, ob.normals);
+		mesh.objects.push_back(obj);
+		ob.signatures.push_back(std::vector<int>());
+		return;
 	}
+
+	ob.byHash.insert(std::make_pair(hash, (int)mesh.objects.size()));
+	ob.signatures.push_back(std::move(sig));
+	mesh.objects.push_back(obj);
 }
 
-Mesh Mesh::FromBSPData(bspdata* bsp)
+Mesh Mesh::FromBSPData(bspdata* bsp, const surface_filter& filter, bool objects)
 {
 	Mesh mesh;
 	std::vector<bool> faceflags(bsp->numFaces);
+	mesh.miptex_to_mat.assign(bsp->miptexListLen, -1);
+	mesh.plane_to_normal.assign(bsp->numPlanes * 2, -1);
+	std::vector<int> scratch(bsp->getMaxFaceVertices());
+
+	// every face contributes at most one vertex per surfedge and one triangle
+	// per edge beyond the second, so reserving for that up front means the
+	// per-face work never reallocates
+	mesh.vertices.reserve(bsp->numEdgeLists);
+	mesh.texcoords.reserve(bsp->numEdgeLists);
+	mesh.indices.reserve(bsp->numEdgeLists * 3);
+	mesh.groups.reserve(bsp->numFaces);
+	mesh.normals.reserve(bsp->numPlanes * 2);
+	mesh.materials.reserve(bsp->miptexListLen);
+
+	std::vector<bool> skip = skippedTexInfos(bsp, filter);
+
+	object_builder ob;
+	auto mark = [&]() {
+		ob.groups = mesh.groups.size();
+		ob.vertices = mesh.vertices.size();
+		ob.indices = mesh.indices.size();
+		ob.normals = mesh.normals.size();
+	};
 
-	pushBSPModel(bsp, 0, mesh, faceflags); // this is the majority of the level
+	if (bsp->numModels > 0) {
+		mark();
+		pushBSPModel(bsp, 0, mesh, faceflags, scratch, skip); // this is the majority of the level
+		if (objects) finishObject(bsp, 0, "world", mesh, ob);
+	}
 
 	// then load only non-trigger models
 	// TODO: could add spawnflags support to remove DM-only and/or shareware stuff.
-	for (auto e : bsp->ent_parser->entities) {
+	for (const auto& e : bsp->getEntities()) {
 		if (e.isLight()) {
-			const ent_property_t *o = e.getProperty("origin");
-			if (o != NULL && o->type == PropertyType::Vector) {
-				const ent_property_t *p = e.getProperty("light");
-				int intensity = (p == NULL) ? 200 : p->number_value;
-				mesh.lights.push_back({
-					o->vector_value[0], o->vector_value[1], o->vector_value[2], (f32)intensity
-				});
-			}
+			pushLight(e, mesh);
 		} else if (!e.isTrigger()) {
 			const ent_property_t *p = e.getProperty("model");
-			if (p != NULL) {
-				pushBSPModel(bsp, p->pointer_value, mesh, faceflags);
+			if (p != NULL && p->pointer_value >= 0 && p->pointer_value < bsp->numModels) {
+				mark();
+				pushBSPModel(bsp, p->pointer_value, mesh, faceflags, scratch, skip);
+				if (objects) {
+					// named for the entity, e.g. func_door_3
+					const ent_property_t *c = e.getProperty("classname");
+					char name[MAX_OBJECT_NAME_LENGTH];
+					snprintf(name, sizeof(name), "%.40s_%i", c != NULL ? c->string_value : "model", p->pointer_value);
+					finishObject(bsp, p->pointer_value, name, mesh, ob);
+				}
 			}
 		}
 	}
 
+	mesh.sortByMaterial();
+	mesh.normals.normalize(); // once, for everything that reads them
+
 	return mesh;
 }
 
+void Mesh::sortByMaterial()
+{
+	// stable counting sort of face groups by material, so BSP (spatial) order
+	// is kept within each bucket; objects are sorted one at a time so each
+	// keeps its groups together
+	std::vector<u32> counts(materials.size() + 1, 0);
+	std::vector<u32> tris(materials.size(), 0);
+	std::vector<mesh_facegroup> sorted(groups.size());
+	IndexStream sortedIndices;
+	sortedIndices.reserve(indices.size());
+	ranges.clear();
+
+	auto sortSpan = [&](u32 firstGroup, u32 numGroups) {
+		std::fill(counts.begin(), counts.end(), 0);
+		std::fill(tris.begin(), tris.end(), 0);
+		for (u32 i = firstGroup; i < firstGroup + numGroups; i++) {
+			counts[groups[i].material + 1]++;
+			tris[groups[i].material] += groups[i].numTris;
+		}
+		counts[0] = firstGroup;
+		for (size_t m = 1; m < counts.size(); m++) counts[m] += counts[m - 1];
+		for (u32 i = firstGroup; i < firstGroup + numGroups; i++) sorted[counts[groups[i].material]++] = groups[i];
+
+		for (u32 i = firstGroup; i < firstGroup + numGroups; i++) {
+			mesh_facegroup& g = sorted[i];
+			if (ranges.empty() || ranges.back().material != g.material || ranges.back().firstGroup < firstGroup) {
+				ranges.push_back(mesh_matrange{
+					g.material, i, 0, (u32)sortedIndices.size(), tris[g.material] * 3
+				});
+			}
+			ranges.back().numGroups++;
+
+			u32 first = sortedIndices.size();
+			for (u32 j = g.firstIndex; j < g.firstIndex + g.numTris * 3; j++) {
+				sortedIndices.push_back(indices[j]);
+			}
+			g.firstIndex = first;
+		}
+	};
+
+	if (objects.empty()) {
+		sortSpan(0, groups.size());
+	} else {
+		for (auto& o: objects) {
+			o.firstRange = ranges.size();
+			sortSpan(o.firstGroup, o.numGroups);
+			o.numRanges = ranges.size() - o.firstRange;
+		}
+	}
+
+	groups = std::move(sorted);
+	indices = std::move(sortedIndices);
+}
+
+void Mesh::truncate(size_t numGroups, size_t numVertices, size_t numIndices, size_t numNormals)
+{
+	if (groups.size() > numGroups) groups.resize(numGroups);
+	vertices.truncate(numVertices);
+	if (texcoords.size() > numVertices) texcoords.resize(numVertices);
+	if (colors.size() > numVertices) colors.resize(numVertices);
+	indices.truncate(numIndices);
+	if (normals.size() > numNormals) {
+		normals.truncate(numNormals);
+		for (auto& n: plane_to_normal) {
+			if (n >= (int)numNormals) n = -1;
+		}
+	}
+}
+
 static std::string replaceChar(const std::string str, const char* subj, const char* repl) {
 	std::string modified = str;
 	std::string::size_type loc = modified.find(subj);
@@ -224,121 +414,294 @@ static std::string replaceChar(const std::string str, const char* subj, const ch
 	return modified;
 }
 
-void Mesh::writeOBJ(FILE *fp, FILE* mp, const char* mpname, const char* texdir)
-{
-	// WRITE OBJ FILE
-	assert(mpname != nullptr);
-	assert(texdir != nullptr);
-	assert(ferror(fp) == 0);
-	assert(ferror(mp) == 0);
+#define OBJ_LINE_MAX 512 // six values of up to 64 characters, and the keyword
 
-	fprintf(fp, "mtllib %s\n", mpname);
+// "%.*f" less trailing zeros and a bare point, with -0 as 0
+static int compactNumber(char* out, f32 v, int precision) {
+	int n = snprintf(out, 64, "%.*f", precision, v);
+	if (n < 0) n = 0;
+	if (n > 63) n = 63;
+	if (memchr(out, '.', n) != NULL) {
+		while (out[n - 1] == '0') n--;
+		if (out[n - 1] == '.') n--;
+	}
+	if (n == 2 && out[0] == '-' && out[1] == '0') {
+		out[0] = '0';
+		n = 1;
+	}
+	return n;
+}
 
-	fprintf(fp, "# vertices\n");
-	for (auto v: vertices) {
-		fprintf(fp, "v %f %f %f 1.0\n", v.x, v.y, v.z);
+// keyword and count values, compact; returns the line's length
+static int compactLine(char* line, const char* keyword, const f32* values, int count, int precision) {
+	int n = strlen(keyword);
+	memcpy(line, keyword, n);
+	for (int i = 0; i < count; i++) {
+		line[n++] = ' ';
+		n += compactNumber(line + n, values[i], precision);
 	}
+	line[n++] = '\n';
+	return n;
+}
 
-	fprintf(fp, "# texcoords\n");
-	for (auto t: texcoords) {
-		fprintf(fp, "vt %f %f 0\n", t.x, t.y);
+static int lineLength(int n) {
+	return n < 0 ? 0 : (n >= OBJ_LINE_MAX ? OBJ_LINE_MAX - 1 : n);
+}
+
+// Each fills line (OBJ_LINE_MAX) with one v, vt or vn line and returns its
+// length; c is the vertex's color, or NULL.
+static int formatVertex(char* line, const mesh_v3& v, const mesh_v3* c, const obj_options& o) {
+	if (o.compact) {
+		f32 values[6] = { v.x, v.y, v.z, 0, 0, 0 };
+		if (c != NULL) {
+			values[3] = c->x;
+			values[4] = c->y;
+			values[5] = c->z;
+		}
+		return compactLine(line, "v", values, c != NULL ? 6 : 3, o.precision);
 	}
+	// the common x y z r g b extension has no room for w
+	if (c != NULL) return lineLength(snprintf(line, OBJ_LINE_MAX, "v %f %f %f %f %f %f\n", v.x, v.y, v.z, c->x, c->y, c->z));
+	return lineLength(snprintf(line, OBJ_LINE_MAX, "v %f %f %f 1.0\n", v.x, v.y, v.z));
+}
 
-	fprintf(fp, "# normals\n");
-	for (auto n: normals) {
-		n.normalize();
-		fprintf(fp, "vn %f %f %f\n", n.x, n.y, n.z);
+static int formatTexcoord(char* line, const mesh_v2& t, const obj_options& o) {
+	if (o.compact) {
+		f32 values[2] = { t.x, t.y };
+		return compactLine(line, "vt", values, 2, o.precision);
 	}
+	return lineLength(snprintf(line, OBJ_LINE_MAX, "vt %f %f 0\n", t.x, t.y));
+}
 
-	fprintf(fp, "# faces\n");
-	char* lastmat = textures[faces[0].material];
-	// fprintf(fp, "usemtl DEBUG\n");
-	fprintf(fp, "usemtl %s\n", lastmat);
-	for (auto f: faces) {
-		if (textures[f.material] != lastmat) {
-			lastmat = textures[f.material];
-			fprintf(fp, "usemtl %s\n", lastmat);
+static int formatNormal(char* line, const mesh_v3& n, const obj_options& o) {
+	if (o.compact) {
+		f32 values[3] = { n.x, n.y, n.z };
+		return compactLine(line, "vn", values, 3, o.precision);
+	}
+	return lineLength(snprintf(line, OBJ_LINE_MAX, "vn %f %f %f\n", n.x, n.y, n.z));
+}
+
+bool Mesh::writeOBJ(FILE *fp, FILE* mp, const char* mpname, const char* texdir, const char* texext, const obj_options& o)
+{
+	// WRITE OBJ FILE
+	assert(mpname != nullptr);
+	assert(texdir != nullptr);
+	assert(ferror(fp) == 0);
+	assert(ferror(mp) == 0);
+
+	// the long sections are formatted in blocks across threads, while a
+	// writer thread drains the finished blocks in order
+	ChunkWriter out(fp);
+
+	out.printf("mtllib %s\n", mpname);
+
+	out.printf("# vertices\n");
+	out.formatParallel(vertices.size(), o.threads, [&](size_t i, TextBuffer& buf) {
+		char line[OBJ_LINE_MAX];
+		buf.write(line, formatVertex(line, vertices[i], colors.empty() ? NULL : &colors[i], o));
+	});
+
+	out.printf("# texcoords\n");
+	out.formatParallel(texcoords.size(), o.threads, [&](size_t i, TextBuffer& buf) {
+		char line[OBJ_LINE_MAX];
+		buf.write(line, formatTexcoord(line, texcoords[i], o));
+	});
+
+	// compact output refers every normal to the first that prints the same
+	out.printf("# normals\n");
+	std::vector<u32> normalIndex(normals.size()); // 1-based, as f lines use them
+	if (o.compact) {
+		std::unordered_map<std::string, u32> printed;
+		for (size_t i = 0; i < normals.size(); i++) {
+			char line[OBJ_LINE_MAX];
+			std::string text(line, formatNormal(line, normals[i], o));
+			auto it = printed.find(text);
+			if (it != printed.end()) {
+				normalIndex[i] = it->second;
+				continue;
+			}
+			normalIndex[i] = printed.size() + 1;
+			printed.insert(std::make_pair(text, normalIndex[i]));
+			out.write(text.data(), text.size());
 		}
+	} else {
+		for (size_t i = 0; i < normals.size(); i++) normalIndex[i] = i + 1;
+		out.formatParallel(normals.size(), o.threads, [&](size_t i, TextBuffer& buf) {
+			char line[OBJ_LINE_MAX];
+			buf.write(line, formatNormal(line, normals[i], o));
+		});
+	}
 
-		fprintf(fp, "f %lli/%lli/%lli %lli/%lli/%lli %lli/%lli/%lli\n",
-			f.vertex[0]+1, f.texcoord[0]+1, f.normal[0]+1,
-			f.vertex[1]+1, f.texcoord[1]+1, f.normal[1]+1,
-			f.vertex[2]+1, f.texcoord[2]+1, f.normal[2]+1
-		);
+	out.printf("# faces\n");
+	// out.printf("usemtl DEBUG\n");
+	// An object's ranges and their groups are contiguous in the indices, so
+	// its faces are formatted as one run of triangles, whatever the material
+	// count. A block finds the range and group its first triangle is in, and
+	// writes usemtl wherever a range starts inside it.
+	auto writeRanges = [&](u32 firstRange, u32 numRanges) {
+		if (numRanges == 0) return;
+		const mesh_matrange* rbegin = &ranges[firstRange];
+		const mesh_matrange* rend = rbegin + numRanges;
+		u32 firstTri = rbegin->firstIndex / 3;
+		u32 numTris = (rend[-1].firstIndex + rend[-1].numIndices) / 3 - firstTri;
+
+		out.formatBlocks(numTris, o.threads, [&](size_t lo, size_t hi, TextBuffer& buf) {
+			u32 t = firstTri + lo, end = firstTri + hi;
+			const mesh_matrange* r = std::upper_bound(rbegin, rend, t * 3,
+				[](u32 i, const mesh_matrange& m) { return i < m.firstIndex; }) - 1;
+			const mesh_facegroup* g = std::upper_bound(&groups[r->firstGroup], &groups[r->firstGroup] + r->numGroups,
+				t * 3, [](u32 i, const mesh_facegroup& fg) { return i < fg.firstIndex; }) - 1;
+			while (t < end) {
+				if (g == &groups[r->firstGroup] && t * 3 == g->firstIndex) {
+					buf.printf("usemtl %s\n", materials[r->material].name);
+				}
+				u32 n = normalIndex[g->normal];
+				u32 stop = std::min(end, g->firstIndex / 3 + g->numTris);
+				for (; t < stop; t++) {
+					u32 a = indices[t*3] + 1, b = indices[t*3+1] + 1, c = indices[t*3+2] + 1;
+					buf.printf("f %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, n, b, b, n, c, c, n);
+				}
+				if (t < end && ++g == &groups[r->firstGroup] + r->numGroups) ++r;
+			}
+		});
+	};
+	if (objects.empty()) {
+		writeRanges(0, ranges.size());
+	}
+	for (const auto& o: objects) {
+		if (o.instanceOf >= 0) continue;
+		out.printf("o %s\n", o.name);
+		writeRanges(o.firstRange, o.numRanges);
 	}
 
 	// We write lights as comments formateed #L x y z v for our own reference
-	fprintf(fp, "# lights (custom data)\n\n");
+	out.printf("# lights (custom data)\n\n");
 	for (auto l: lights) {
-		fprintf(fp, "#L %f %f %f %f\n", l.x, l.y, l.z, l.level);
+		out.printf("#L %f %f %f %f\n", l.x, l.y, l.z, l.level);
 	}
-	fprintf(fp, "\n\n");
 
+	// and objects as #B name minx miny minz maxx maxy maxz, with instances
+	// (which have no faces of their own) as #I name source dx dy dz
+	if (!objects.empty()) {
+		out.printf("\n# objects (custom data)\n\n");
+		for (const auto& o: objects) {
+			out.printf("#B %s %f %f %f %f %f %f\n", o.name, o.mins.x, o.mins.y, o.mins.z, o.maxs.x, o.maxs.y, o.maxs.z);
+		}
+		for (const auto& o: objects) {
+			if (o.instanceOf < 0) continue;
+			out.printf("#I %s %s %f %f %f\n", o.name, objects[o.instanceOf].name, o.offset.x, o.offset.y, o.offset.z);
+		}
+	}
+	out.printf("\n\n");
 
-	// WRITE MAT FILE
+	writeMTL(mp, texdir, texext);
+	return out.finish() && ferror(mp) == 0;
+}
 
+void Mesh::writeMTL(FILE* mp, const char* texdir, const char* texext) const
+{
 	fprintf(mp, "newmtl DEBUG\n");
 	fprintf(mp, "Ka 1.0 1.0 1.0\nKd 1.0 1.0 1.0\nKs 0.0 0.0 0.0\n");
 	fprintf(mp, "d 1.0\nillum 2\n");
 
-	for (int t = 0; t < nTextures; t++) {
-		const auto m = textures[t];
+	for (size_t t = 0; t < materials.size(); t++) {
+		const auto m = materials[t].name;
 		std::string file_ok_name = replaceChar(m, "*", "_");
 		fprintf(mp, "newmtl %s\n", m);
 		fprintf(mp, "Ka 1.0 1.0 1.0\nKd 1.0 1.0 1.0\nKs 0.0 0.0 0.0\n");
 		fprintf(mp, "d 1.0\nillum 2\n");
-		fprintf(mp, "map_Ka %s/%s.tga\n", texdir, file_ok_name.c_str());
-		fprintf(mp, "map_Kd %s/%s.tga\n", texdir, file_ok_name.c_str());
-		fprintf(mp, "map_Ks %s/%s.tga\n", texdir, file_ok_name.c_str());
+		fprintf(mp, "map_Ka %s/%s.%s\n", texdir, file_ok_name.c_str(), texext);
+		fprintf(mp, "map_Kd %s/%s.%s\n", texdir, file_ok_name.c_str(), texext);
+		fprintf(mp, "map_Ks %s/%s.%s\n", texdir, file_ok_name.c_str(), texext);
 		fprintf(mp, "\n\n");
 	}
 }
 
-int Mesh::texLookup(int miptex)
+static const char* faceStatusDescriptions[] = {
+	"ok",
+	"fewer than three vertices",
+	"all vertices the same",
+	"all vertices colinear",
+	"invalid vertex coordinates",
+};
+
+void mesh_diagnostics::record(int face, FaceStatus status)
 {
-	auto search = miptex_to_texidx.find(miptex);
-	if (search != miptex_to_texidx.end()) {
-		return search->second;
-	}
-	return -1;
-}
-
-bool Mesh::grow_texture_list() {
-	char** texlist = (char**)realloc(textures, sizeof(char*) * (maxTextures << 1));
-	if (texlist != NULL) {
-		size_t old_max = maxTextures;
-		textures = texlist;
-		maxTextures = maxTextures << 1;
-		for (int i = old_max; i < maxTextures; i++) {
-			textures[i] = NULL;
-			textures[i] = (char*)malloc(MAX_TEXTURE_NAME_LENGTH * sizeof(char));
-			memset(textures[i], 0, MAX_TEXTURE_NAME_LENGTH);
-			if (textures[i] == NULL) {
-				fprintf(stderr, "FAILED malloc of %i bytes at texture index %i.\n",
-						MAX_TEXTURE_NAME_LENGTH, i);
-			}
+	counts[(int)status]++;
+	faces.push_back(mesh_badface{face, status});
+}
+
+void mesh_diagnostics::writeSummary(FILE* fp) const
+{
+	if (faces.empty()) return;
+	fprintf(fp, "Skipped %lu degenerate face(s):\n", (unsigned long)faces.size());
+	for (int s = 1; s < (int)FaceStatus::Count; s++) {
+		if (counts[s] > 0) fprintf(fp, "  %i %s\n", counts[s], faceStatusDescriptions[s]);
+	}
+}
+
+void mesh_diagnostics::writeDetails(FILE* fp, const bspdata* bsp) const
+{
+	for (auto f: faces) {
+		fprintf(fp, "Face #%i: %s\n", f.face, faceStatusDescriptions[(int)f.status]);
+		for (auto v: bsp->getFaceVertices(f.face)) {
+			fprintf(fp, "  {%f, %f, %f}\n", v.point[0], v.point[1], v.point[2]);
 		}
-	} else return false;
-	return true;
+	}
+}
+
+int Mesh::texLookup(int miptex)
+{
+	if (miptex < 0 || miptex >= (int)miptex_to_mat.size()) return -1;
+	return miptex_to_mat[miptex];
 }
 
 int Mesh::texInsert(int miptex, const miptex_t* info)
 {
-	assert(strlen(info->name) > 0);
 	assert(info != NULL);
+	assert(strlen(info->name) > 0);
+	assert(miptex >= 0);
 
-	int idx = nTextures;
-	if (idx >= maxTextures) {
-		grow_texture_list();
+	if (miptex >= (int)miptex_to_mat.size()) {
+		miptex_to_mat.resize(miptex + 1, -1);
 	}
 
 	// textures/materials are basically the same thing right now
-	++nTextures;
-	strncpy(textures[idx], info->name, MAX_TEXTURE_NAME_LENGTH);
-	assert(strlen(textures[idx]) > 0);
+	int idx = materials.size();
+	mesh_mat mat;
+	strncpy(mat.name, info->name, MAX_TEXTURE_NAME_LENGTH - 1);
+	mat.name[MAX_TEXTURE_NAME_LENGTH - 1] = 0;
+	mat.miptex = miptex;
+	materials.push_back(mat);
+
+	miptex_to_mat[miptex] = idx;
+	return idx;
+}
+
+int Mesh::normalLookup(int planenum, int side)
+{
+	int slot = planenum * 2 + (side ? 1 : 0);
+	if (slot < 0 || slot >= (int)plane_to_normal.size()) return -1;
+	return plane_to_normal[slot];
+}
 
-	materials.push_back(mesh_mat{idx});
-	miptex_to_texidx[miptex] = idx;
+int Mesh::normalInsert(int planenum, int side, const dplane_t* plane)
+{
+	assert(plane != NULL);
+	assert(planenum >= 0);
+
+	int slot = planenum * 2 + (side ? 1 : 0);
+	if (slot >= (int)plane_to_normal.size()) {
+		plane_to_normal.resize(slot + 1, -1);
+	}
+
+	// faces on the back of a plane point the other way
+	mesh_v3 n = { plane->normal[0], plane->normal[1], plane->normal[2] };
+	if (side) n = -n;
+
+	int idx = normals.size();
+	normals.push_back(n);
+	plane_to_normal[slot] = idx;
 	return idx;
 }
 
@@ -362,7 +725,8 @@ static mesh_v3 transform(const mesh_v3& v, const f32* m) {
 	};
 }
 
-void Mesh::rotate(const f32 rad, const mesh_v3& axis)
+// column-major 4x4 rotating rad about axis
+static void rotationMatrix(const f32 rad, const mesh_v3& axis, f32 m[16])
 {
 	f32 x = axis.x;
 	f32 y = axis.y;
@@ -377,20 +741,24 @@ void Mesh::rotate(const f32 rad, const mesh_v3& axis)
 	f32 c = cosf(rad);
 	f32 t = 1.0f - c;
 
-	f32 m[16] = {
+	const f32 r[16] = {
 		x * x * t + c, y * x * t + z * s, z * x * t - y * s, 0,
 		x * y * t - z * s, y * y * t + c, z * y * t + x * s, 0,
 		x * z * t + y * s, y * z * t - x * s, z * z * t + c, 0,
 		0, 0, 0, 1
 	};
+	memcpy(m, r, sizeof(r));
+}
+
+void Mesh::rotate(const f32 rad, const mesh_v3& axis)
+{
+	f32 m[16];
+	rotationMatrix(rad, axis, m);
 
 	// k now the fun part :p
-	for (size_t i = 0; i < vertices.size(); i++) { // rotate vertices about center
-		vertices[i] = transform(vertices[i], m);
-	}
-	for (size_t i = 0; i < normals.size(); i++) { // normals too
-		normals[i] = transform(normals[i], m);
-	}
+	vertices.transform(m); // rotate vertices about center
+	normals.transform(m); // normals too, kept unit length
+	normals.normalize();
 	for (size_t i = 0; i < lights.size(); i++) { // and lights
 		mesh_v3 lpos = {lights[i].x, lights[i].y, lights[i].z};
 		lpos = transform(lpos, m);
@@ -398,51 +766,165 @@ void Mesh::rotate(const f32 rad, const mesh_v3& axis)
 		lights[i].y = lpos.y;
 		lights[i].z = lpos.z;
 	}
+	for (auto& o: objects) { // and object bounds, which stay axis-aligned
+		mesh_v3 lo = o.mins, hi = o.maxs;
+		for (int c = 0; c < 8; c++) {
+			mesh_v3 corner = { (c & 1) ? hi.x : lo.x, (c & 2) ? hi.y : lo.y, (c & 4) ? hi.z : lo.z };
+			corner = transform(corner, m);
+			o.mins = c == 0 ? corner : v3min(o.mins, corner);
+			o.maxs = c == 0 ? corner : v3max(o.maxs, corner);
+		}
+		o.offset = transform(o.offset, m);
+	}
 }
 
 void Mesh::translate(const mesh_v3& translation)
 {
-	for (size_t i = 0; i < vertices.size(); i++) vertices[i] += translation;
+	vertices.translate(translation);
 	for (size_t l = 0; l < lights.size(); l++) {
 		lights[l].x += translation.x;
 		lights[l].y += translation.y;
 		lights[l].z += translation.z;
 	}
+	for (auto& o: objects) { // instance offsets are relative, so they stay
+		o.mins += translation;
+		o.maxs += translation;
+	}
 }
 
 void Mesh::scale(const f32& s)
 {
-	for (size_t i = 0; i < vertices.size(); i++) vertices[i] *= s;
+	vertices.scale(s);
 	for (size_t l = 0; l < lights.size(); l++) {
 		lights[l].x *= s;
 		lights[l].y *= s;
 		lights[l].z *= s;
 		lights[l].level *= s; // assumes level of "200" is "radius of 200 units until ineffective"
 	}
+	for (auto& o: objects) {
+		o.mins *= s;
+		o.maxs *= s;
+		o.offset *= s;
+	}
 }
 
 void Mesh::getBoundingBox(mesh_v3* minp, mesh_v3* maxp) const
 {
-	*minp = vertices[0];
-	*maxp = vertices[0];
-	for (size_t i = 1; i < vertices.size(); i++) {
-		*minp = v3min(*minp, vertices[i]);
-		*maxp = v3max(*maxp, vertices[i]);
+	vertices.bounds(minp, maxp);
+}
+
+void Mesh::place(const mesh_placement& p)
+{
+	translate(-p.center);
+	scale(p.scale);
+	rotate(p.angle, p.axis);
+}
+
+bool Mesh::streamOBJ(bspdata* bsp, const surface_filter& filter, const mesh_placement& place, FILE* fp, FILE* mp,
+	const char* mpname, const char* texdir, const char* texext, const obj_options& o)
+{
+	assert(mpname != nullptr);
+	assert(texdir != nullptr);
+
+	// this mesh only ever holds the face being written; materials and normals
+	// stay, so each is written once, the first time a face uses it
+	miptex_to_mat.assign(bsp->miptexListLen, -1);
+	plane_to_normal.assign(bsp->numPlanes * 2, -1);
+	std::vector<bool> faceflags(bsp->numFaces);
+	std::vector<int> scratch(bsp->getMaxFaceVertices());
+	std::vector<bool> skip = skippedTexInfos(bsp, filter);
+	vertices.reserve(scratch.size());
+	texcoords.reserve(scratch.size());
+	indices.reserve(scratch.size() * 3);
+
+	f32 m[16];
+	rotationMatrix(place.angle, place.axis, m);
+
+	ChunkWriter out(fp);
+	out.printf("mtllib %s\n", mpname);
+
+	size_t written = 0; // vertices before this face, in every face so far
+	size_t normalsWritten = 0;
+	u32 material = (u32)-1;
+	auto streamModel = [&](int model) {
+		const f32* mo = bsp->models[model].origin;
+		mesh_v3 origin = { mo[0], mo[1], mo[2] };
+		forEachModelFace(bsp, model, faceflags, skip, [&](int f) {
+			vertices.clear();
+			texcoords.clear();
+			indices.clear();
+			groups.clear();
+			pushBSPFace(bsp, f, origin, *this, scratch.data(), scratch.size());
+			if (groups.empty()) return; // degenerate
+
+			vertices.translate(-place.center);
+			vertices.scale(place.scale);
+			vertices.transform(m);
+			char line[OBJ_LINE_MAX];
+			for (size_t i = 0; i < vertices.size(); i++) {
+				out.write(line, formatVertex(line, vertices[i], NULL, o));
+			}
+			for (const auto& t: texcoords) {
+				out.write(line, formatTexcoord(line, t, o));
+			}
+			if (normalsWritten < normals.size()) { // a new one, placed like the vertices
+				for (size_t i = normalsWritten; i < normals.size(); i++) normals.set(i, transform(normals[i], m));
+				normals.normalize(normalsWritten);
+			}
+			for (; normalsWritten < normals.size(); normalsWritten++) {
+				out.write(line, formatNormal(line, normals[normalsWritten], o));
+			}
+
+			const mesh_facegroup& g = groups[0];
+			if (g.material != material) {
+				material = g.material;
+				out.printf("usemtl %s\n", materials[material].name);
+			}
+			u32 n = g.normal + 1;
+			for (u32 i = 0; i < g.numTris * 3; i += 3) {
+				u32 a = written + indices[i] + 1, b = written + indices[i+1] + 1, c = written + indices[i+2] + 1;
+				out.printf("f %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, n, b, b, n, c, c, n);
+			}
+			written += vertices.size();
+		});
+	};
+
+	if (bsp->numModels > 0) streamModel(0);
+	for (const auto& e : bsp->getEntities()) {
+		if (e.isLight()) {
+			pushLight(e, *this);
+		} else if (!e.isTrigger()) {
+			const ent_property_t *p = e.getProperty("model");
+			if (p != NULL && p->pointer_value >= 0 && p->pointer_value < bsp->numModels) streamModel(p->pointer_value);
+		}
 	}
+
+	// with the geometry gone, placing the mesh just places the lights
+	vertices.clear();
+	normals.clear();
+	this->place(place);
+	out.printf("# lights (custom data)\n\n");
+	for (auto l: lights) {
+		out.printf("#L %f %f %f %f\n", l.x, l.y, l.z, l.level);
+	}
+	out.printf("\n\n");
+
+	writeMTL(mp, texdir, texext);
+	return out.finish() && ferror(mp) == 0;
 }
 
 mesh_v3 v3min(const mesh_v3& a, const mesh_v3& b) {
 	return mesh_v3{
-		fmax(a.x, b.x),
-		fmax(a.y, b.y),
-		fmax(a.z, b.z)
+		fminf(a.x, b.x),
+		fminf(a.y, b.y),
+		fminf(a.z, b.z)
 	};
 }
 
 mesh_v3 v3max(const mesh_v3& a, const mesh_v3& b) {
 	return mesh_v3{
-		fmin(a.x, b.x),
-		fmin(a.y, b.y),
-		fmin(a.z, b.z)
+		fmaxf(a.x, b.x),
+		fmaxf(a.y, b.y),
+		fmaxf(a.z, b.z)
 	};
 }
@@ -0,0 +1,231 @@
+#include "meshfile.hpp"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static u32 align32(u32 n) {
+	return (n + 31) & ~31u;
+}
+
+static u32 fnv1a(const void* data, size_t bytes) {
+	const unsigned char* p = (const unsigned char*)data;
+	u32 h = 2166136261u;
+	for (size_t i = 0; i < bytes; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static u32 headerChecksum(meshfile_header hdr) {
+	hdr.checksum = 0;
+	return fnv1a(&hdr, sizeof(hdr));
+}
+
+MeshFile::~MeshFile()
+{
+	if (mapped != NULL) munmap(mapped, mappedSize);
+}
+
+bool MeshFile::write(FILE* fp, const Mesh& mesh, const char* texdir, const char* texext)
+{
+	u32 numVertices = mesh.vertices.size();
+	std::vector<f32> positions(numVertices * 3);
+	for (u32 i = 0; i < numVertices; i++) {
+		mesh_v3 v = mesh.vertices[i];
+		positions[i * 3] = v.x;
+		positions[i * 3 + 1] = v.y;
+		positions[i * 3 + 2] = v.z;
+	}
+
+	// a vertex belongs to one face group, and so has that group's normal
+	std::vector<f32> normals(numVertices * 3);
+	for (const auto& g: mesh.groups) {
+		mesh_v3 n = mesh.normals[g.normal];
+		for (u32 i = g.firstIndex; i < g.firstIndex + g.numTris * 3; i++) {
+			u32 v = mesh.indices[i];
+			normals[v * 3] = n.x;
+			normals[v * 3 + 1] = n.y;
+			normals[v * 3 + 2] = n.z;
+		}
+	}
+
+	std::vector<meshfile_range> ranges(mesh.ranges.size());
+	for (size_t i = 0; i < ranges.size(); i++) {
+		ranges[i].material = mesh.ranges[i].material;
+		ranges[i].firstIndex = mesh.ranges[i].firstIndex;
+		ranges[i].numIndices = mesh.ranges[i].numIndices;
+		ranges[i].reserved = 0;
+	}
+
+	std::vector<meshfile_texture> textures(mesh.materials.size());
+	for (size_t i = 0; i < textures.size(); i++) {
+		meshfile_texture& t = textures[i];
+		memset(&t, 0, sizeof(t));
+		snprintf(t.name, sizeof(t.name), "%s", mesh.materials[i].name);
+		int n = snprintf(t.file, sizeof(t.file), "%s/%s.%s", texdir, mesh.materials[i].name, texext);
+		if (n < 0 || (size_t)n >= sizeof(t.file)) {
+			fprintf(stderr, "Texture path too long for a mesh file: %s/%s.%s\n", texdir, mesh.materials[i].name,
+				texext);
+			return false;
+		}
+		// named as writeMTL names them
+		for (char* c = t.file + strlen(texdir); *c; c++) {
+			if (*c == '*') *c = '_';
+		}
+	}
+
+	meshfile_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ident = MESHFILE_IDENT;
+	hdr.version = MESHFILE_VERSION;
+	hdr.numVertices = numVertices;
+	hdr.numIndices = mesh.indices.size();
+	hdr.indexSize = mesh.indices.isWide() ? 4 : 2;
+	if (numVertices > 0) {
+		mesh_v3 mins, maxs;
+		mesh.getBoundingBox(&mins, &maxs);
+		hdr.mins[0] = mins.x; hdr.mins[1] = mins.y; hdr.mins[2] = mins.z;
+		hdr.maxs[0] = maxs.x; hdr.maxs[1] = maxs.y; hdr.maxs[2] = maxs.z;
+	}
+
+	const void* data[MESHFILE_SECTIONS] = {
+		positions.data(), normals.data(), mesh.texcoords.data(), mesh.colors.data(),
+		mesh.indices.data(), ranges.data(), mesh.lights.data(), textures.data(),
+	};
+	const u32 counts[MESHFILE_SECTIONS] = {
+		numVertices, numVertices, numVertices, (u32)mesh.colors.size(),
+		hdr.numIndices, (u32)ranges.size(), (u32)mesh.lights.size(), (u32)textures.size(),
+	};
+	const u32 sizes[MESHFILE_SECTIONS] = {
+		3 * sizeof(f32), 3 * sizeof(f32), sizeof(mesh_v2), sizeof(mesh_v3),
+		hdr.indexSize, sizeof(meshfile_range), sizeof(mesh_light), sizeof(meshfile_texture),
+	};
+	u32 at = align32(sizeof(hdr));
+	for (int s = 0; s < MESHFILE_SECTIONS; s++) {
+		meshfile_section& sec = hdr.sections[s];
+		sec.offset = at;
+		sec.count = counts[s];
+		sec.length = counts[s] * sizes[s];
+		sec.checksum = fnv1a(data[s], sec.length);
+		at = align32(at + sec.length);
+	}
+	hdr.filelen = hdr.sections[MESHFILE_SECTIONS - 1].offset + hdr.sections[MESHFILE_SECTIONS - 1].length;
+	hdr.checksum = headerChecksum(hdr);
+
+	static const char zeros[32] = {0};
+	size_t pos = 0;
+	auto put = [&](u32 ofs, const void* bytes, size_t len) {
+		bool ok = fwrite(zeros, 1, ofs - pos, fp) == ofs - pos;
+		ok = ok && fwrite(bytes, 1, len, fp) == len;
+		pos = ofs + len;
+		return ok;
+	};
+	bool ok = put(0, &hdr, sizeof(hdr));
+	for (int s = 0; s < MESHFILE_SECTIONS; s++) {
+		ok = put(hdr.sections[s].offset, data[s], hdr.sections[s].length) && ok;
+	}
+	return ok && ferror(fp) == 0;
+}
+
+// everything but the checksums and indices, which are as long as the mesh
+static bool checkLayout(const meshfile_header& hdr, const char* data, size_t size) {
+	if (hdr.ident != MESHFILE_IDENT || hdr.version != MESHFILE_VERSION || hdr.filelen > size
+		|| (hdr.indexSize != 2 && hdr.indexSize != 4) || hdr.checksum != headerChecksum(hdr)) {
+		return false;
+	}
+
+	const u32 sizes[MESHFILE_SECTIONS] = {
+		3 * sizeof(f32), 3 * sizeof(f32), sizeof(mesh_v2), sizeof(mesh_v3),
+		hdr.indexSize, sizeof(meshfile_range), sizeof(mesh_light), sizeof(meshfile_texture),
+	};
+	for (int s = 0; s < MESHFILE_SECTIONS; s++) {
+		const meshfile_section& sec = hdr.sections[s];
+		if (sec.offset % 32 != 0 || sec.offset < sizeof(hdr) || (size_t)sec.offset + sec.length > hdr.filelen
+			|| (unsigned long long)sec.count * sizes[s] != sec.length) {
+			return false;
+		}
+	}
+	const meshfile_section* sec = hdr.sections;
+	if (sec[MESHFILE_POSITIONS].count != hdr.numVertices || sec[MESHFILE_NORMALS].count != hdr.numVertices
+		|| sec[MESHFILE_TEXCOORDS].count != hdr.numVertices || sec[MESHFILE_INDICES].count != hdr.numIndices
+		|| (sec[MESHFILE_COLORS].count != 0 && sec[MESHFILE_COLORS].count != hdr.numVertices)) {
+		return false;
+	}
+
+	const meshfile_range* r = (const meshfile_range*)(data + sec[MESHFILE_RANGES].offset);
+	for (u32 i = 0; i < sec[MESHFILE_RANGES].count; i++) {
+		if (r[i].material >= sec[MESHFILE_TEXTURES].count
+			|| (unsigned long long)r[i].firstIndex + r[i].numIndices > hdr.numIndices) {
+			return false;
+		}
+	}
+	const meshfile_texture* t = (const meshfile_texture*)(data + sec[MESHFILE_TEXTURES].offset);
+	for (u32 i = 0; i < sec[MESHFILE_TEXTURES].count; i++) {
+		if (memchr(t[i].name, 0, sizeof(t[i].name)) == NULL || memchr(t[i].file, 0, sizeof(t[i].file)) == NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool MeshFile::open(const char* path, bool verify)
+{
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s for reading.\n", path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(meshfile_header)) {
+		fprintf(stderr, "%s is too small to be a mesh file.\n", path);
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s.\n", path);
+		return false;
+	}
+
+	meshfile_header h;
+	memcpy(&h, data, sizeof(h));
+	size_t size = st.st_size;
+	const char* bytes = (const char*)data;
+	if (!checkLayout(h, bytes, size)) {
+		fprintf(stderr, "%s isn't a usable mesh file.\n", path);
+		munmap(data, size);
+		return false;
+	}
+
+	bool ok = true;
+	for (int s = 0; s < MESHFILE_SECTIONS && verify && ok; s++) {
+		ok = fnv1a(bytes + h.sections[s].offset, h.sections[s].length) == h.sections[s].checksum;
+	}
+	const char* idx = bytes + h.sections[MESHFILE_INDICES].offset;
+	for (u32 i = 0; i < h.numIndices && verify && ok; i++) {
+		ok = (h.indexSize == 2 ? ((const u16*)idx)[i] : ((const u32*)idx)[i]) < h.numVertices;
+	}
+	if (!ok) {
+		fprintf(stderr, "%s is damaged.\n", path);
+		munmap(data, size);
+		return false;
+	}
+
+	if (mapped != NULL) munmap(mapped, mappedSize);
+	mapped = data;
+	mappedSize = size;
+	base = bytes;
+	hdr = h;
+	return true;
+}
+
+void MeshFile::bounds(mesh_v3* minp, mesh_v3* maxp) const
+{
+	*minp = mapped ? mesh_v3{hdr.mins[0], hdr.mins[1], hdr.mins[2]} : mesh_v3();
+	*maxp = mapped ? mesh_v3{hdr.maxs[0], hdr.maxs[1], hdr.maxs[2]} : mesh_v3();
+}
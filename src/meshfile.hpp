@@ -0,0 +1,104 @@
+#ifndef MESHFILE_H_INCLUDED
+#define MESHFILE_H_INCLUDED
+
+#include "common.h"
+#include <stdio.h>
+#include <stddef.h>
+#include "mesh.hpp"
+
+#define MESHFILE_IDENT (('1'<<24)|('H'<<16)|('S'<<8)|'M') // "MSH1"
+#define MESHFILE_VERSION 1
+#define MESHFILE_TEXTURE_PATH 96 // texdir/name.ext, terminated
+
+enum MeshFileSection {
+	MESHFILE_POSITIONS, // three f32 per vertex
+	MESHFILE_NORMALS, // three f32 per vertex, unit length
+	MESHFILE_TEXCOORDS, // two f32 per vertex
+	MESHFILE_COLORS, // three f32 per vertex; empty unless baked
+	MESHFILE_INDICES, // three per triangle, of header.indexSize bytes each
+	MESHFILE_RANGES, // meshfile_range, one per material, in index order
+	MESHFILE_LIGHTS, // mesh_light
+	MESHFILE_TEXTURES, // meshfile_texture, indexed by meshfile_range::material
+	MESHFILE_SECTIONS
+};
+
+struct meshfile_section {
+	u32 offset; // bytes from the start of the file, a multiple of 32
+	u32 length; // in bytes
+	u32 count; // elements
+	u32 checksum; // FNV-1a of the section's bytes
+};
+
+// A .mesh file is this header followed by its sections, each 32-byte
+// aligned and stored little-endian, so a consumer can map the file and hand
+// the arrays straight to a renderer. Its checksum covers the header with
+// the checksum itself taken as 0.
+struct meshfile_header {
+	int ident;
+	int version;
+	u32 filelen;
+	u32 checksum;
+	u32 numVertices, numIndices;
+	u32 indexSize; // 2 or 4
+	u32 reserved;
+	f32 mins[3], maxs[3];
+	meshfile_section sections[MESHFILE_SECTIONS];
+};
+
+struct meshfile_range {
+	u32 material;
+	u32 firstIndex, numIndices;
+	u32 reserved;
+};
+
+struct meshfile_texture {
+	char name[32];
+	char file[MESHFILE_TEXTURE_PATH]; // as the MTL's map_Kd names it
+};
+
+// A mesh as written to a .mesh file: what the OBJ holds, with normals per
+// vertex rather than per face, laid out for use in place. Objects aren't
+// kept; their triangles are still in the ranges.
+class MeshFile {
+	const char* base = NULL;
+	meshfile_header hdr = meshfile_header();
+
+	void* mapped = NULL;
+	size_t mappedSize = 0;
+
+	const void* section(int s) const { return base + hdr.sections[s].offset; }
+public:
+	MeshFile() { }
+	~MeshFile();
+	MeshFile(const MeshFile& other) = delete;
+
+	// the mesh should already be placed and sorted by material
+	static bool write(FILE* fp, const Mesh& mesh, const char* texdir, const char* texext = "tga");
+	// Maps a file written by write; nothing is copied. The header and the
+	// section bounds are always checked, and with verify the checksums and
+	// every index are too.
+	bool open(const char* path, bool verify = true);
+
+	u32 vertexCount() const { return mapped ? hdr.numVertices : 0; }
+	u32 indexCount() const { return mapped ? hdr.numIndices : 0; }
+	u32 indexSize() const { return hdr.indexSize; }
+	u32 rangeCount() const { return mapped ? hdr.sections[MESHFILE_RANGES].count : 0; }
+	u32 lightCount() const { return mapped ? hdr.sections[MESHFILE_LIGHTS].count : 0; }
+	u32 textureCount() const { return mapped ? hdr.sections[MESHFILE_TEXTURES].count : 0; }
+	bool hasColors() const { return mapped && hdr.sections[MESHFILE_COLORS].count > 0; }
+	void bounds(mesh_v3* minp, mesh_v3* maxp) const;
+
+	const f32* positions() const { return (const f32*)section(MESHFILE_POSITIONS); }
+	const f32* normals() const { return (const f32*)section(MESHFILE_NORMALS); }
+	const f32* texcoords() const { return (const f32*)section(MESHFILE_TEXCOORDS); }
+	const f32* colors() const { return hasColors() ? (const f32*)section(MESHFILE_COLORS) : NULL; }
+	const void* indices() const { return section(MESHFILE_INDICES); } // u16 or u32, by indexSize
+	u32 index(u32 i) const {
+		return hdr.indexSize == 2 ? ((const u16*)indices())[i] : ((const u32*)indices())[i];
+	}
+	const meshfile_range* ranges() const { return (const meshfile_range*)section(MESHFILE_RANGES); }
+	const mesh_light* lights() const { return (const mesh_light*)section(MESHFILE_LIGHTS); }
+	const meshfile_texture* textures() const { return (const meshfile_texture*)section(MESHFILE_TEXTURES); }
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "outputsink.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+FILE* DirectorySink::open(const std::string& name) {
+	FILE* fp = fopen(name.c_str(), "wb");
+	if (fp == NULL) fprintf(stderr, "Couldn't open %s for writing.\n", name.c_str());
+	return fp;
+}
+
+bool DirectorySink::close(FILE* fp) {
+	bool ok = ferror(fp) == 0;
+	return fclose(fp) == 0 && ok;
+}
+
+std::string DirectorySink::materialName(const std::string& matfile) const {
+	return matfile;
+}
+
+TarSink::TarSink(FILE* fp, bool ownsFile) : out(fp), owned(ownsFile) { }
+
+TarSink::~TarSink() {
+	finish();
+}
+
+FILE* TarSink::open(const std::string& name) {
+	pending* p = new pending{name, NULL, 0};
+	FILE* fp = open_memstream(&p->data, &p->size);
+	if (fp == NULL) {
+		fprintf(stderr, "Couldn't buffer %s for the archive.\n", name.c_str());
+		delete p;
+		return NULL;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	open_files[fp] = p;
+	return fp;
+}
+
+// ustar header fields are NUL-terminated octal
+static void octal(char* field, size_t width, unsigned long long value) {
+	snprintf(field, width, "%0*llo", (int)width - 1, value);
+}
+
+bool TarSink::close(FILE* fp) {
+	pending* p;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = open_files.find(fp);
+		if (it == open_files.end()) return false;
+		p = it->second;
+		open_files.erase(it);
+	}
+	bool ok = ferror(fp) == 0;
+	ok = fclose(fp) == 0 && ok; // data and size are final from here
+
+	char hdr[512];
+	memset(hdr, 0, sizeof(hdr));
+	std::string name = p->name;
+	std::string prefix;
+	if (name.size() > 100) {
+		// split at a '/' so the name fits in name (100) plus prefix (155)
+		std::string::size_type slash = name.find('/', name.size() - 101);
+		if (slash == std::string::npos || slash > 155) {
+			fprintf(stderr, "Name too long for the archive: %s\n", name.c_str());
+			free(p->data);
+			delete p;
+			return false;
+		}
+		prefix = name.substr(0, slash);
+		name = name.substr(slash + 1);
+	}
+	memcpy(hdr, name.data(), name.size());
+	octal(hdr + 100, 8, 0644);
+	octal(hdr + 108, 8, 0);
+	octal(hdr + 116, 8, 0);
+	octal(hdr + 124, 12, p->size);
+	octal(hdr + 136, 12, (unsigned long long)time(NULL));
+	hdr[156] = '0';
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+	memcpy(hdr + 345, prefix.data(), prefix.size());
+
+	// checksum counts its own field as spaces
+	memset(hdr + 148, ' ', 8);
+	unsigned int sum = 0;
+	for (int i = 0; i < 512; i++) sum += (unsigned char)hdr[i];
+	snprintf(hdr + 148, 8, "%06o", sum);
+	hdr[155] = ' ';
+
+	static const char zeros[512] = {0};
+	size_t padding = (512 - p->size % 512) % 512;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		bool wrote = fwrite(hdr, 1, 512, out) == 512;
+		wrote = wrote && fwrite(p->data, 1, p->size, out) == p->size;
+		wrote = wrote && fwrite(zeros, 1, padding, out) == padding;
+		if (!wrote) failed = true;
+		ok = ok && wrote;
+	}
+
+	free(p->data);
+	delete p;
+	return ok;
+}
+
+std::string TarSink::materialName(const std::string& matfile) const {
+	std::string::size_type slash = matfile.rfind('/');
+	return slash == std::string::npos ? matfile : matfile.substr(slash + 1);
+}
+
+bool TarSink::finish() {
+	std::lock_guard<std::mutex> guard(lock);
+	if (out == NULL) return !failed;
+	static const char zeros[1024] = {0};
+	if (fwrite(zeros, 1, sizeof(zeros), out) != sizeof(zeros)) failed = true;
+	if (owned) {
+		if (fclose(out) != 0) failed = true;
+	} else if (fflush(out) != 0) {
+		failed = true;
+	}
+	out = NULL;
+	return !failed;
+}
@@ -0,0 +1,56 @@
+#ifndef OUTPUTSINK_H_INCLUDED
+#define OUTPUTSINK_H_INCLUDED
+
+#include <stdio.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Where the MTL and textures go. Files are written through ordinary FILE
+// pointers, so the writers don't care whether they land in a directory or
+// an archive. open and close may be called from several threads at once.
+class OutputSink {
+public:
+	virtual ~OutputSink() { }
+	// name is relative to the sink, e.g. "textures/wall.tga"; NULL on failure
+	virtual FILE* open(const std::string& name) = 0;
+	// finishes a file from open; false if any of it failed to write
+	virtual bool close(FILE* fp) = 0;
+	// the name an OBJ's mtllib should use for a material file
+	virtual std::string materialName(const std::string& matfile) const = 0;
+};
+
+// Plain files, relative to the working directory.
+class DirectorySink : public OutputSink {
+public:
+	FILE* open(const std::string& name) override;
+	bool close(FILE* fp) override;
+	std::string materialName(const std::string& matfile) const override;
+};
+
+// A ustar archive, written sequentially so it can go to a pipe. Each file is
+// buffered in memory until it's closed, then appended whole.
+class TarSink : public OutputSink {
+	struct pending {
+		std::string name;
+		char* data;
+		size_t size;
+	};
+	FILE* out;
+	bool owned; // false for stdout
+	bool failed = false;
+	std::mutex lock;
+	std::map<FILE*, pending*> open_files;
+public:
+	TarSink(FILE* fp, bool ownsFile);
+	~TarSink();
+	TarSink(const TarSink& other) = delete;
+
+	FILE* open(const std::string& name) override;
+	bool close(FILE* fp) override;
+	std::string materialName(const std::string& matfile) const override;
+	// writes the end-of-archive blocks; false if anything failed along the way
+	bool finish();
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "pakfile.hpp"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PakFile::~PakFile() {
+	if (base != NULL) munmap((void*)base, size);
+	if (fd >= 0) close(fd);
+}
+
+bool PakFile::open(const char* path)
+{
+	filename = path;
+	fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s for reading.\n", path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(dpackheader_t)) {
+		fprintf(stderr, "%s is too small to be a pak.\n", path);
+		return false;
+	}
+	size = st.st_size;
+
+	void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapped == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s.\n", path);
+		return false;
+	}
+	base = (const unsigned char*)mapped;
+
+	dpackheader_t hdr;
+	memcpy(&hdr, base, sizeof(hdr));
+	if (hdr.ident != PAK_IDENT) {
+		fprintf(stderr, "%s isn't a PACK file.\n", path);
+		return false;
+	}
+	if (hdr.dirofs < 0 || hdr.dirlen < 0 || (size_t)hdr.dirofs + hdr.dirlen > size
+		|| hdr.dirlen % sizeof(dpackfile_t) != 0 || hdr.dirofs % 4 != 0) {
+		fprintf(stderr, "%s has a damaged directory.\n", path);
+		return false;
+	}
+	dir = (const dpackfile_t*)(base + hdr.dirofs);
+	numEntries = hdr.dirlen / sizeof(dpackfile_t);
+	return true;
+}
+
+// entry names aren't guaranteed to be terminated within their 56 bytes
+static std::string entryName(const dpackfile_t& e) {
+	return std::string(e.name, strnlen(e.name, sizeof(e.name)));
+}
+
+std::vector<std::string> PakFile::list(const char* prefix, const char* suffix) const
+{
+	std::vector<std::string> names;
+	size_t plen = strlen(prefix), slen = strlen(suffix);
+	for (int i = 0; i < numEntries; i++) {
+		std::string name = entryName(dir[i]);
+		if (name.size() < plen + slen) continue;
+		if (strncasecmp(name.c_str(), prefix, plen) != 0) continue;
+		if (strcasecmp(name.c_str() + name.size() - slen, suffix) != 0) continue;
+		names.push_back(name);
+	}
+	return names;
+}
+
+const unsigned char* PakFile::find(const char* name, size_t* len) const
+{
+	for (int i = 0; i < numEntries; i++) {
+		if (entryName(dir[i]) != name) continue;
+		const dpackfile_t& e = dir[i];
+		if (e.filepos < 0 || e.filelen < 0 || (size_t)e.filepos + e.filelen > size) {
+			fprintf(stderr, "Pak entry %s runs past the end of the file.\n", name);
+			return NULL;
+		}
+		*len = e.filelen;
+		return base + e.filepos;
+	}
+	fprintf(stderr, "No %s in the pak.\n", name);
+	return NULL;
+}
+
+bool splitPakPath(const std::string& path, std::string* pak, std::string* entry)
+{
+	std::string::size_type sep = path.find(".pak:");
+	if (sep == std::string::npos) sep = path.find(".PAK:");
+	if (sep == std::string::npos) return false;
+	*pak = path.substr(0, sep + 4);
+	*entry = path.substr(sep + 5);
+	return true;
+}
@@ -0,0 +1,49 @@
+#ifndef PAKFILE_H_INCLUDED
+#define PAKFILE_H_INCLUDED
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define PAK_IDENT (('K'<<24)|('C'<<16)|('A'<<8)|'P') // "PACK"
+
+struct dpackheader_t {
+	int ident;
+	int dirofs;
+	int dirlen;
+};
+
+struct dpackfile_t {
+	char name[56];
+	int filepos, filelen;
+};
+
+// A Quake PACK archive, mapped read-only. Entries are handed out as pointers
+// into the mapping, so a map loads straight from the archive with no copy
+// on disk.
+class PakFile {
+	int fd = -1;
+	const unsigned char* base = NULL;
+	size_t size = 0;
+	const dpackfile_t* dir = NULL;
+	int numEntries = 0;
+	std::string filename;
+public:
+	PakFile() { }
+	~PakFile();
+	PakFile(const PakFile& other) = delete;
+
+	bool open(const char* path);
+	const std::string& path() const { return filename; }
+	// names of the entries under prefix with the given extension, in
+	// directory order, e.g. list("maps/", ".bsp")
+	std::vector<std::string> list(const char* prefix, const char* suffix) const;
+	// the entry's bytes, or NULL if there's no such entry
+	const unsigned char* find(const char* name, size_t* len) const;
+};
+
+// "id1/pak0.pak:maps/e1m1.bsp" names a map inside an archive. Splits such a
+// name into its archive and entry; false for a plain path.
+bool splitPakPath(const std::string& path, std::string* pak, std::string* entry);
+
+#endif
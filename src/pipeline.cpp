@@ -0,0 +1,443 @@
+#include "pipeline.hpp"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "boundedqueue.hpp"
+#include "bspdata.hpp"
+#include "mesh.hpp"
+#include "bvh.hpp"
+#include "meshfile.hpp"
+
+struct loaded_map {
+	size_t job;
+	std::shared_ptr<bspdata> bsp; // empty if the load failed
+};
+
+typedef BoundedQueue<std::shared_ptr<bspdata>> texture_queue;
+
+struct texture_ctx {
+	texture_queue* queue;
+	std::shared_ptr<bspdata> bsp;
+};
+
+// called by the loader once a map's miptex lump is in; the texture stage
+// holds its own reference, so the map lives until both stages are done
+static void queueTextures(const bspdata*, void* ctx) {
+	texture_ctx* tc = (texture_ctx*)ctx;
+	tc->queue->push(tc->bsp);
+}
+
+std::string replaceExtension(const char* path, const char* ext) {
+	std::string out(path);
+	std::string::size_type dot = out.rfind('.');
+	std::string::size_type slash = out.rfind('/');
+	if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) out.erase(dot);
+	return out + "." + ext;
+}
+
+// "maps/e1m1.obj" with suffix "_sky" is "maps/e1m1_sky.obj"
+static std::string suffixedPath(const std::string& path, const char* suffix) {
+	std::string::size_type dot = path.rfind('.');
+	std::string::size_type slash = path.rfind('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return path + suffix;
+	return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+// centers on center, then scales and rotates the way every output is
+static mesh_placement outputPlacement(const mesh_v3& center) {
+	// shrink it down (quake is integer-scaled), then correct rotation to
+	// OpenGL-style z-is-depth
+	return mesh_placement{center, 0.1f, -PiOver2, mesh_v3{1.0, 0, 0}};
+}
+
+// opens one OBJ and its MTL, the MTL going through sink, and has write fill
+// them
+template<typename F>
+static bool writeOutputFiles(const std::string& outfile, const std::string& matfile, OutputSink* sink, F write)
+{
+	bool tostdout = outfile == "-";
+	FILE *outfp = tostdout ? stdout : fopen(outfile.c_str(), "w");
+	if (outfp == NULL) {
+		fprintf(stderr, "Couldn't open %s for writing.\n", outfile.c_str());
+		return false;
+	}
+
+	std::string matname = sink->materialName(matfile);
+	FILE *matfp = sink->open(matname);
+	if (matfp == NULL) {
+		if (!tostdout) fclose(outfp);
+		return false;
+	}
+
+	bool ok = write(outfp, matfp, matname.c_str());
+	ok = sink->close(matfp) && ok;
+	if (tostdout) {
+		ok = fflush(outfp) == 0 && ok;
+	} else {
+		ok = fclose(outfp) == 0 && ok;
+	}
+	if (!ok) fprintf(stderr, "Couldn't write %s.\n", outfile.c_str());
+	return ok;
+}
+
+// writes one OBJ and its MTL, and its BVH and mesh file when asked for
+static bool writeMeshFiles(Mesh& mesh, const std::string& outfile, const std::string& matfile,
+	const convert_options& opts, OutputSink* sink)
+{
+	bool ok = writeOutputFiles(outfile, matfile, sink, [&](FILE* outfp, FILE* matfp, const char* matname) {
+		return mesh.writeOBJ(outfp, matfp, matname, opts.texdir, textureExtension(opts.texformat), opts.obj);
+	});
+
+	if (opts.bvh && outfile != "-") {
+		std::string bvhfile = replaceExtension(outfile.c_str(), "bvh");
+		BVH bvh;
+		bvh.build(mesh);
+		FILE* bp = fopen(bvhfile.c_str(), "wb");
+		bool wrote = bp != NULL && bvh.write(bp);
+		if (bp != NULL) wrote = fclose(bp) == 0 && wrote;
+		if (!wrote) fprintf(stderr, "Couldn't write %s.\n", bvhfile.c_str());
+		ok = ok && wrote;
+	}
+
+	if (opts.meshfile && outfile != "-") {
+		std::string meshfile = replaceExtension(outfile.c_str(), "mesh");
+		FILE* mf = fopen(meshfile.c_str(), "wb");
+		bool wrote = mf != NULL && MeshFile::write(mf, mesh, opts.texdir, textureExtension(opts.texformat));
+		if (mf != NULL) wrote = fclose(mf) == 0 && wrote;
+		if (!wrote) fprintf(stderr, "Couldn't write %s.\n", meshfile.c_str());
+		ok = ok && wrote;
+	}
+	return ok;
+}
+
+// Streams the map's OBJ out face by face. Nothing is built first, so it's
+// centered on the world model's bounds rather than on its faces.
+static bool streamLoadedMap(const convert_job& job, bspdata* bsp, const convert_options& opts,
+	const surface_filter& included, OutputSink* sink, FILE* report, bool batch)
+{
+	if (bsp->numModels == 0) {
+		fprintf(stderr, "%s has no world model.\n", job.infile.c_str());
+		return false;
+	}
+
+	const dmodel_t& world = bsp->models[0];
+	mesh_v3 center = (mesh_v3(world.mins[0], world.mins[1], world.mins[2])
+		+ mesh_v3(world.maxs[0], world.maxs[1], world.maxs[2])) * 0.5f;
+	Mesh mesh;
+	bool ok = writeOutputFiles(job.outfile, job.matfile, sink, [&](FILE* outfp, FILE* matfp, const char* matname) {
+		return mesh.streamOBJ(bsp, included, outputPlacement(center), outfp, matfp, matname, opts.texdir,
+			textureExtension(opts.texformat), opts.obj);
+	});
+
+	// skipped faces are only known once they've all been seen
+	flockfile(stderr);
+	if (batch && !mesh.diagnostics.faces.empty()) fprintf(stderr, "%s:\n", job.infile.c_str());
+	mesh.diagnostics.writeSummary(stderr);
+	funlockfile(stderr);
+	if (report != NULL) {
+		flockfile(report);
+		if (batch) fprintf(report, "# %s\n", job.infile.c_str());
+		mesh.diagnostics.writeDetails(report, bsp);
+		funlockfile(report);
+	}
+	return ok;
+}
+
+bool convertLoadedMap(const convert_job& job, bspdata* bsp, const convert_options& opts, OutputSink* sink,
+	FILE* report, bool batch)
+{
+	surface_filter included;
+	std::vector<SurfaceClass> separate;
+	for (int c = 0; c < (int)SurfaceClass::Count; c++) {
+		included.keep[c] = opts.surfaces[c] == SurfaceAction::Include;
+		if (opts.surfaces[c] == SurfaceAction::Separate) separate.push_back((SurfaceClass)c);
+	}
+	if ((!separate.empty() || opts.bvh || opts.meshfile) && job.outfile == "-") {
+		fprintf(stderr, "Separate surface meshes, BVHs and mesh files need a named OBJ file, not stdout.\n");
+		return false;
+	}
+	if (opts.stream) {
+		if (!separate.empty() || opts.objects || opts.bake || opts.bvh || opts.meshfile) {
+			fprintf(stderr, "Streaming can't separate surfaces, split objects, bake, or write a BVH or mesh file.\n");
+			return false;
+		}
+		return streamLoadedMap(job, bsp, opts, included, sink, report, batch);
+	}
+
+	std::vector<Mesh> meshes;
+	meshes.push_back(Mesh::FromBSPData(bsp, included, opts.objects));
+	for (auto c: separate) {
+		surface_filter only;
+		for (auto& k: only.keep) k = false;
+		only.keep[(int)c] = true;
+		meshes.push_back(Mesh::FromBSPData(bsp, only, opts.objects));
+	}
+
+	// report skipped faces once, rather than as they're found; the stream
+	// locks keep each map's lines together when several convert at once
+	bool skipped = false;
+	for (const auto& mesh: meshes) skipped = skipped || !mesh.diagnostics.faces.empty();
+	flockfile(stderr);
+	if (batch && skipped) fprintf(stderr, "%s:\n", job.infile.c_str());
+	for (const auto& mesh: meshes) mesh.diagnostics.writeSummary(stderr);
+	funlockfile(stderr);
+	if (report != NULL) {
+		flockfile(report);
+		if (batch) fprintf(report, "# %s\n", job.infile.c_str());
+		for (const auto& mesh: meshes) mesh.diagnostics.writeDetails(report, bsp);
+		funlockfile(report);
+	}
+
+	// bake in map units, where light levels are distances; everything is
+	// lit and shadowed by the main mesh
+	if (opts.bake) {
+		BVH occluders;
+		occluders.build(meshes[0], opts.bakeopts.threads);
+		for (auto& mesh: meshes) bakeVertexColors(mesh, occluders, opts.bakeopts);
+	}
+
+	// center on the main mesh, so separated surfaces stay where they were
+	// relative to it
+	mesh_v3 bmin, bmax;
+	meshes[0].getBoundingBox(&bmin, &bmax);
+	mesh_v3 center = (bmin + bmax) * 0.5;
+
+	// write our OBJ and MTL files
+	bool ok = true;
+	for (size_t m = 0; m < meshes.size(); m++) {
+		meshes[m].place(outputPlacement(center));
+		if (m == 0) {
+			ok = writeMeshFiles(meshes[m], job.outfile, job.matfile, opts, sink) && ok;
+			continue;
+		}
+		std::string suffix = std::string("_") + surfaceClassName(separate[m - 1]);
+		ok = writeMeshFiles(meshes[m], suffixedPath(job.outfile, suffix.c_str()),
+			suffixedPath(job.matfile, suffix.c_str()), opts, sink) && ok;
+	}
+	return ok;
+}
+
+bool loadMap(const std::string& infile, bspdata* bsp, bsp_loaded_fn texturesReady, void* ctx,
+	std::shared_ptr<PakFile>* pak)
+{
+	std::string pakname, entry;
+	if (splitPakPath(infile, &pakname, &entry)) {
+		std::shared_ptr<PakFile> local;
+		if (pak == NULL) pak = &local;
+		if (!*pak || pakname != (*pak)->path()) {
+			pak->reset(new PakFile());
+			if (!(*pak)->open(pakname.c_str())) {
+				pak->reset();
+				return false;
+			}
+		}
+		size_t len = 0;
+		const unsigned char* data = (*pak)->find(entry.c_str(), &len);
+		if (data == NULL) return false;
+		// the map reads its lumps out of the mapping as it needs them
+		if (!bsp->loadFromMemory(data, len, texturesReady, ctx, *pak)) {
+			fprintf(stderr, "Couldn't load %s.\n", infile.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool fromstdin = infile == "-";
+	FILE *fp = fromstdin ? stdin : fopen(infile.c_str(), "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Couldn't open %s for reading.\n", infile.c_str());
+		return false;
+	}
+	bool ok = bsp->loadFromFilePointer(fp, texturesReady, ctx);
+	if (!ok) fprintf(stderr, "Couldn't load %s.\n", infile.c_str());
+	if (!fromstdin) fclose(fp);
+	return ok;
+}
+
+OutputSink* createOutputSink(const convert_options& opts)
+{
+	if (opts.archive == NULL) return new DirectorySink();
+	if (!strcmp(opts.archive, "-")) return new TarSink(stdout, false);
+
+	FILE* fp = fopen(opts.archive, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Couldn't open %s for writing.\n", opts.archive);
+		return NULL;
+	}
+	return new TarSink(fp, true);
+}
+
+bool parseConvertOption(int argc, const char* const* argv, int* i, convert_options* opts, std::string* err)
+{
+	const char* arg = argv[*i];
+	bool hasValue = *i + 1 < argc;
+
+	if (!strcmp(arg, "--report") && hasValue) {
+		opts->reportfile = argv[++*i];
+	} else if (!strcmp(arg, "--texdir") && hasValue) {
+		opts->texdir = argv[++*i];
+	} else if (!strcmp(arg, "--archive") && hasValue) {
+		opts->archive = argv[++*i];
+	} else if (!strcmp(arg, "--surface") && hasValue) {
+		// class=action, e.g. sky=exclude
+		const char* spec = argv[++*i];
+		const char* eq = strchr(spec, '=');
+		int c = 0;
+		while (c < (int)SurfaceClass::Count && (eq == NULL
+			|| strlen(surfaceClassName((SurfaceClass)c)) != (size_t)(eq - spec)
+			|| strncmp(spec, surfaceClassName((SurfaceClass)c), eq - spec) != 0)) c++;
+		if (c == (int)SurfaceClass::Count) {
+			*err = std::string("Unknown surface class in ") + spec + ".";
+			return false;
+		}
+		if (!strcmp(eq + 1, "include")) {
+			opts->surfaces[c] = SurfaceAction::Include;
+		} else if (!strcmp(eq + 1, "exclude")) {
+			opts->surfaces[c] = SurfaceAction::Exclude;
+		} else if (!strcmp(eq + 1, "separate")) {
+			opts->surfaces[c] = SurfaceAction::Separate;
+		} else {
+			*err = std::string("Unknown surface action in ") + spec + ".";
+			return false;
+		}
+	} else if (!strcmp(arg, "--bvh")) {
+		opts->bvh = true;
+	} else if (!strcmp(arg, "--mesh")) {
+		opts->meshfile = true;
+	} else if (!strcmp(arg, "--stream")) {
+		opts->stream = true;
+	} else if (!strcmp(arg, "--bake")) {
+		opts->bake = true;
+	} else if (!strcmp(arg, "--ao-samples") && hasValue) {
+		opts->bakeopts.aoSamples = atoi(argv[++*i]);
+		opts->bake = true;
+	} else if (!strcmp(arg, "--objects")) {
+		opts->objects = true;
+	} else if (!strcmp(arg, "--no-textures")) {
+		opts->textures = false;
+	} else if (!strcmp(arg, "--dds")) {
+		opts->texformat = TextureFormat::DDS;
+	} else if (!strcmp(arg, "--compress") && hasValue) {
+		const char* fmt = argv[++*i];
+		if (!strcmp(fmt, "bc3")) {
+			opts->bc.keyed = BlockFormat::BC3;
+		} else if (!strcmp(fmt, "bc7")) {
+			opts->bc.keyed = BlockFormat::BC7;
+		} else {
+			*err = std::string("Unknown compression format ") + fmt + ".";
+			return false;
+		}
+		opts->compress = true;
+		opts->texformat = TextureFormat::DDS;
+	} else if (!strcmp(arg, "--quality") && hasValue) {
+		const char* q = argv[++*i];
+		if (!strcmp(q, "fast")) {
+			opts->bc.quality = BlockQuality::Fast;
+		} else if (!strcmp(q, "normal")) {
+			opts->bc.quality = BlockQuality::Normal;
+		} else if (!strcmp(q, "high")) {
+			opts->bc.quality = BlockQuality::High;
+		} else {
+			*err = std::string("Unknown quality ") + q + ".";
+			return false;
+		}
+	} else if (!strcmp(arg, "--threads") && hasValue) {
+		opts->bc.threads = atoi(argv[++*i]);
+	} else if (!strcmp(arg, "--write-threads") && hasValue) {
+		opts->obj.threads = atoi(argv[++*i]);
+	} else if (!strcmp(arg, "--compact")) {
+		opts->obj.compact = true;
+	} else if (!strcmp(arg, "--precision") && hasValue) {
+		int p = atoi(argv[++*i]);
+		opts->obj.precision = p < 0 ? 0 : (p > 8 ? 8 : p);
+		opts->obj.compact = true;
+	} else if (!strcmp(arg, "--jobs") && hasValue) {
+		opts->jobs = atoi(argv[++*i]);
+	} else {
+		*err = std::string("Unknown option ") + arg + ".";
+		return false;
+	}
+	return true;
+}
+
+int convertMaps(const std::vector<convert_job>& jobs, const convert_options& opts)
+{
+	for (const auto& job: jobs) {
+		if (job.outfile == "-" && opts.archive != NULL && !strcmp(opts.archive, "-")) {
+			fprintf(stderr, "The OBJ and the archive can't both go to stdout.\n");
+			return jobs.size();
+		}
+	}
+	std::unique_ptr<OutputSink> sink(createOutputSink(opts));
+	if (!sink) return jobs.size();
+
+	FILE *report = NULL;
+	if (opts.reportfile != NULL) {
+		report = fopen(opts.reportfile, "w");
+		if (report == NULL) fprintf(stderr, "Couldn't open %s for writing.\n", opts.reportfile);
+	}
+
+	const bool batch = jobs.size() > 1;
+	const bc_options* bc = opts.compress ? &opts.bc : NULL;
+
+	// the loader runs one map ahead of each convert worker
+	const int nworkers = opts.jobs > 1 ? opts.jobs : 1;
+	BoundedQueue<loaded_map> loaded(nworkers);
+	texture_queue textures(2);
+
+	std::thread loader([&]() {
+		std::shared_ptr<PakFile> pak; // consecutive entries of one archive share its mapping
+		for (size_t j = 0; j < jobs.size(); j++) {
+			loaded_map m;
+			m.job = j;
+			auto bsp = std::make_shared<bspdata>();
+			texture_ctx tc = { &textures, bsp };
+			bsp_loaded_fn ready = opts.textures ? queueTextures : NULL;
+			if (loadMap(jobs[j].infile, bsp.get(), ready, &tc, &pak)) m.bsp = bsp;
+			loaded.push(std::move(m));
+		}
+		loaded.close();
+		textures.close();
+	});
+
+	// a map whose textures couldn't all be written counts as failed, as one
+	// that didn't convert does
+	std::atomic<int> failed(0);
+
+	// one map's textures at a time: maps in a batch share the texture
+	// directory, and extractTextures is already parallel inside
+	std::thread extractor([&]() {
+		std::shared_ptr<bspdata> bsp;
+		while (textures.pop(bsp)) {
+			if (!bsp->extractTextures(opts.texdir, opts.texformat, bc, sink.get())) failed++;
+			bsp.reset();
+		}
+	});
+
+	auto convert = [&]() {
+		loaded_map m;
+		while (loaded.pop(m)) {
+			if (!m.bsp || !convertLoadedMap(jobs[m.job], m.bsp.get(), opts, sink.get(), report, batch)) failed++;
+			m.bsp.reset();
+		}
+	};
+	std::vector<std::thread> converters;
+	for (int w = 1; w < nworkers; w++) converters.emplace_back(convert);
+	convert();
+	for (auto& t: converters) t.join();
+
+	loader.join();
+	extractor.join();
+	if (report != NULL) fclose(report);
+
+	TarSink* tar = dynamic_cast<TarSink*>(sink.get());
+	if (tar != NULL && !tar->finish()) {
+		fprintf(stderr, "Couldn't write %s.\n", opts.archive);
+		failed++;
+	}
+	return failed;
+}
@@ -0,0 +1,79 @@
+#ifndef PIPELINE_H_INCLUDED
+#define PIPELINE_H_INCLUDED
+
+#include <stdio.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "indexedimage.hpp"
+#include "bcenc.hpp"
+#include "bake.hpp"
+#include "outputsink.hpp"
+#include "bspdata.hpp"
+#include "pakfile.hpp"
+
+// What a conversion does with each class of surface. Separate ones are
+// written to a second OBJ beside the first, named outfile_class.obj with its
+// own outfile_class.mtl, placed so the two line up.
+enum class SurfaceAction {
+	Include,
+	Exclude,
+	Separate
+};
+
+struct convert_options {
+	const char* reportfile = NULL; // per-face detail for skipped faces
+	const char* texdir = "textures";
+	const char* archive = NULL; // tar to put the MTL and textures in; "-" for stdout
+	bool textures = true; // false leaves texture pixels unread
+	bool objects = false; // each brush model its own object, repeats instanced
+	bool bvh = false; // write outfile's BVH beside it, see bvh.hpp
+	bool meshfile = false; // write outfile's mesh file beside it, see meshfile.hpp
+	bool stream = false; // write faces as they're built, see Mesh::streamOBJ
+	bool bake = false; // light and occlusion baked into vertex colors
+	bake_options bakeopts;
+	TextureFormat texformat = TextureFormat::TGA;
+	bool compress = false; // block-compress DDS output with bc
+	bc_options bc;
+	int jobs = 1; // maps converted at once in a batch
+	obj_options obj; // how the OBJ's text is written
+	SurfaceAction surfaces[(int)SurfaceClass::Count] = {}; // indexed by SurfaceClass
+};
+
+// infile "-" reads the map from stdin, and "archive.pak:maps/name.bsp" reads
+// it from inside a pak. outfile "-" writes the OBJ to stdout.
+struct convert_job {
+	std::string infile, outfile, matfile;
+};
+
+// swaps the extension of the file name, or appends one if it has none
+std::string replaceExtension(const char* path, const char* ext);
+
+// Parses the conversion option at argv[*i], moving *i past its value.
+// Shared by the command line and daemon requests.
+bool parseConvertOption(int argc, const char* const* argv, int* i, convert_options* opts, std::string* err);
+
+// Loads a map from any kind of infile. pak, if given, keeps the last archive
+// mapped between calls, so consecutive entries of one pak share it.
+bool loadMap(const std::string& infile, bspdata* bsp, bsp_loaded_fn texturesReady, void* ctx,
+	std::shared_ptr<PakFile>* pak);
+
+// Builds, writes and reports one already-loaded map, with the MTL going to
+// sink; textures are left to the caller. batch prefixes diagnostics with the
+// map's name.
+bool convertLoadedMap(const convert_job& job, bspdata* bsp, const convert_options& opts, OutputSink* sink,
+	FILE* report, bool batch);
+
+// The sink opts asks for: a tar archive, or plain files. NULL if the archive
+// can't be created.
+OutputSink* createOutputSink(const convert_options& opts);
+
+// Converts every job through three overlapping stages joined by bounded
+// queues: a loader, a texture extractor that starts as soon as a map's miptex
+// lump is read, and the mesh build plus OBJ write on the calling thread and
+// opts.jobs - 1 more. The loader stays at most one map ahead of each convert
+// worker, so the next map's load overlaps the current map's write. Returns
+// the number of jobs that failed.
+int convertMaps(const std::vector<convert_job>& jobs, const convert_options& opts);
+
+#endif
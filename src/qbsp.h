@@ -40,7 +40,12 @@ typedef unsigned char byte;
 #define BSPVERSION	29
 #define	TOOLVERSION	2
 
-#pragma pack(4)
+// large-map variants: 32-bit indices throughout. 2PSB keeps short node/leaf
+// bounds, BSP2 widens those to floats as well.
+#define BSP2VERSION_2PSB	(('B' << 24) | ('S' << 16) | ('P' << 8) | '2')
+#define BSP2VERSION_BSP2	(('B' << 0) | ('S' << 8) | ('P' << 16) | ('2' << 24))
+
+#pragma pack(push, 4)
 struct lump_t {
 	int		fileofs, filelen;
 };
@@ -90,7 +95,6 @@ typedef struct
 	int			firstface, numfaces;
 } dmodel_t;
 
-#pragma pack(4)
 struct dheader_t {
 	int			version;
 	lump_t		lumps[HEADER_LUMPS];
@@ -170,6 +174,35 @@ typedef struct
 	short		children[2];	// negative numbers are contents
 } dclipnode_t;
 
+// 2PSB node: 32-bit children and faces, short bounds
+typedef struct
+{
+	int			planenum;
+	int			children[2];
+	short		mins[3];
+	short		maxs[3];
+	unsigned int	firstface;
+	unsigned int	numfaces;
+} dnode2psb_t;
+
+// BSP2 node: 32-bit children and faces, float bounds
+typedef struct
+{
+	int			planenum;
+	int			children[2];
+	float		mins[3];
+	float		maxs[3];
+	unsigned int	firstface;
+	unsigned int	numfaces;
+} dnode2_t;
+
+// BSP2/2PSB clipnode
+typedef struct
+{
+	int			planenum;
+	int			children[2];
+} dclipnode2_t;
+
 
 typedef struct texinfo_s
 {
@@ -186,6 +219,12 @@ typedef struct
 	unsigned short	v[2];		// vertex numbers
 } dedge_t;
 
+// BSP2/2PSB edge
+typedef struct
+{
+	unsigned int	v[2];
+} dedge2_t;
+
 #define	MAXLIGHTMAPS	4
 typedef struct
 {
@@ -201,6 +240,20 @@ typedef struct
 	int			lightofs;		// start of [numstyles*surfsize] samples
 } dface_t;
 
+// BSP2/2PSB face
+typedef struct
+{
+	int			planenum;
+	int			side;
+
+	int			firstedge;
+	int			numedges;
+	int			texinfo;
+
+	byte		styles[MAXLIGHTMAPS];
+	int			lightofs;
+} dface2_t;
+
 
 
 #define	AMBIENT_WATER	0
@@ -226,6 +279,38 @@ typedef struct
 	byte		ambient_level[NUM_AMBIENTS];
 } dleaf_t;
 
+// 2PSB leaf: 32-bit marksurfaces, short bounds
+typedef struct
+{
+	int			contents;
+	int			visofs;
+
+	short		mins[3];
+	short		maxs[3];
+
+	unsigned int	firstmarksurface;
+	unsigned int	nummarksurfaces;
+
+	byte		ambient_level[NUM_AMBIENTS];
+} dleaf2psb_t;
+
+// BSP2 leaf: 32-bit marksurfaces, float bounds
+typedef struct
+{
+	int			contents;
+	int			visofs;
+
+	float		mins[3];
+	float		maxs[3];
+
+	unsigned int	firstmarksurface;
+	unsigned int	nummarksurfaces;
+
+	byte		ambient_level[NUM_AMBIENTS];
+} dleaf2_t;
+
+
+#pragma pack(pop)
 
 //============================================================================
 
@@ -0,0 +1,279 @@
+#include "vertexstream.hpp"
+#include "mesh.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define VERTEXSTREAM_SSE 1
+#endif
+
+static f32* alloc_stream(size_t n) {
+	void* p = NULL;
+	if (posix_memalign(&p, VERTEXSTREAM_ALIGN, n * sizeof(f32)) != 0) return NULL;
+	memset(p, 0, n * sizeof(f32));
+	return (f32*)p;
+}
+
+// number of lanes the kernels touch: size rounded up to a whole SIMD block
+static size_t padded(size_t n) {
+	return (n + VERTEXSTREAM_LANES - 1) & ~(size_t)(VERTEXSTREAM_LANES - 1);
+}
+
+VertexStream::VertexStream() { }
+
+VertexStream::~VertexStream() {
+	release();
+}
+
+void VertexStream::release() {
+	if (xs != nullptr) free(xs);
+	if (ys != nullptr) free(ys);
+	if (zs != nullptr) free(zs);
+	xs = ys = zs = nullptr;
+}
+
+VertexStream::VertexStream(VertexStream&& other) {
+	xs = other.xs; other.xs = nullptr;
+	ys = other.ys; other.ys = nullptr;
+	zs = other.zs; other.zs = nullptr;
+	count = other.count; other.count = 0;
+	cap = other.cap; other.cap = 0;
+}
+
+VertexStream& VertexStream::operator=(VertexStream&& other) {
+	if (this != &other) {
+		release();
+		xs = other.xs; other.xs = nullptr;
+		ys = other.ys; other.ys = nullptr;
+		zs = other.zs; other.zs = nullptr;
+		count = other.count; other.count = 0;
+		cap = other.cap; other.cap = 0;
+	}
+	return *this;
+}
+
+bool VertexStream::grow(size_t mincap) {
+	size_t ncap = cap > 0 ? cap : 64;
+	while (ncap < mincap) ncap <<= 1;
+	ncap = padded(ncap);
+
+	f32* nx = alloc_stream(ncap);
+	f32* ny = alloc_stream(ncap);
+	f32* nz = alloc_stream(ncap);
+	if (nx == NULL || ny == NULL || nz == NULL) {
+		fprintf(stderr, "FAILED allocation of vertex stream with %lu entries.\n", (unsigned long)ncap);
+		if (nx != NULL) free(nx);
+		if (ny != NULL) free(ny);
+		if (nz != NULL) free(nz);
+		return false;
+	}
+	if (count > 0) {
+		memcpy(nx, xs, count * sizeof(f32));
+		memcpy(ny, ys, count * sizeof(f32));
+		memcpy(nz, zs, count * sizeof(f32));
+	}
+	release();
+	xs = nx; ys = ny; zs = nz;
+	cap = ncap;
+	return true;
+}
+
+void VertexStream::reserve(size_t n) {
+	if (n > cap) grow(n);
+}
+
+void VertexStream::push_back(const mesh_v3& v) {
+	if (count >= cap && !grow(count + 1)) return;
+	xs[count] = v.x;
+	ys[count] = v.y;
+	zs[count] = v.z;
+	count++;
+}
+
+mesh_v3 VertexStream::operator[](size_t i) const {
+	return mesh_v3{ xs[i], ys[i], zs[i] };
+}
+
+void VertexStream::set(size_t i, const mesh_v3& v) {
+	xs[i] = v.x;
+	ys[i] = v.y;
+	zs[i] = v.z;
+}
+
+mesh_v3 VertexStream::const_iterator::operator*() const {
+	return (*s)[i];
+}
+
+void VertexStream::bounds(mesh_v3* minp, mesh_v3* maxp) const
+{
+	if (count == 0) {
+		*minp = mesh_v3();
+		*maxp = mesh_v3();
+		return;
+	}
+
+	size_t i = 0;
+	f32 mn[3] = { xs[0], ys[0], zs[0] };
+	f32 mx[3] = { xs[0], ys[0], zs[0] };
+
+#ifdef VERTEXSTREAM_SSE
+	// padding lanes hold stale data, so only whole blocks of live vertices
+	// go through the vector path and the rest is folded in below
+	size_t blocks = count & ~(size_t)(VERTEXSTREAM_LANES - 1);
+	if (blocks > 0) {
+		__m128 minx = _mm_load_ps(xs), maxx = minx;
+		__m128 miny = _mm_load_ps(ys), maxy = miny;
+		__m128 minz = _mm_load_ps(zs), maxz = minz;
+		for (i = VERTEXSTREAM_LANES; i < blocks; i += VERTEXSTREAM_LANES) {
+			__m128 x = _mm_load_ps(xs + i);
+			__m128 y = _mm_load_ps(ys + i);
+			__m128 z = _mm_load_ps(zs + i);
+			minx = _mm_min_ps(minx, x); maxx = _mm_max_ps(maxx, x);
+			miny = _mm_min_ps(miny, y); maxy = _mm_max_ps(maxy, y);
+			minz = _mm_min_ps(minz, z); maxz = _mm_max_ps(maxz, z);
+		}
+		f32 lanes[6][VERTEXSTREAM_LANES];
+		_mm_storeu_ps(lanes[0], minx); _mm_storeu_ps(lanes[1], miny); _mm_storeu_ps(lanes[2], minz);
+		_mm_storeu_ps(lanes[3], maxx); _mm_storeu_ps(lanes[4], maxy); _mm_storeu_ps(lanes[5], maxz);
+		for (int l = 0; l < VERTEXSTREAM_LANES; l++) {
+			for (int c = 0; c < 3; c++) {
+				mn[c] = fminf(mn[c], lanes[c][l]);
+				mx[c] = fmaxf(mx[c], lanes[c+3][l]);
+			}
+		}
+		i = blocks;
+	}
+#endif
+
+	for (; i < count; i++) {
+		mn[0] = fminf(mn[0], xs[i]); mx[0] = fmaxf(mx[0], xs[i]);
+		mn[1] = fminf(mn[1], ys[i]); mx[1] = fmaxf(mx[1], ys[i]);
+		mn[2] = fminf(mn[2], zs[i]); mx[2] = fmaxf(mx[2], zs[i]);
+	}
+
+	*minp = mesh_v3{ mn[0], mn[1], mn[2] };
+	*maxp = mesh_v3{ mx[0], mx[1], mx[2] };
+}
+
+void VertexStream::transform(const f32* m)
+{
+	size_t n = padded(count);
+#ifdef VERTEXSTREAM_SSE
+	const __m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]);
+	const __m128 m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]), m6 = _mm_set1_ps(m[6]);
+	const __m128 m8 = _mm_set1_ps(m[8]), m9 = _mm_set1_ps(m[9]), m10 = _mm_set1_ps(m[10]);
+	for (size_t i = 0; i < n; i += VERTEXSTREAM_LANES) {
+		__m128 x = _mm_load_ps(xs + i);
+		__m128 y = _mm_load_ps(ys + i);
+		__m128 z = _mm_load_ps(zs + i);
+		_mm_store_ps(xs + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, x), _mm_mul_ps(m4, y)), _mm_mul_ps(m8, z)));
+		_mm_store_ps(ys + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, x), _mm_mul_ps(m5, y)), _mm_mul_ps(m9, z)));
+		_mm_store_ps(zs + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, x), _mm_mul_ps(m6, y)), _mm_mul_ps(m10, z)));
+	}
+#else
+	for (size_t i = 0; i < n; i++) {
+		f32 x = xs[i], y = ys[i], z = zs[i];
+		xs[i] = m[0] * x + m[4] * y + m[8] * z;
+		ys[i] = m[1] * x + m[5] * y + m[9] * z;
+		zs[i] = m[2] * x + m[6] * y + m[10] * z;
+	}
+#endif
+}
+
+void VertexStream::translate(const mesh_v3& t, size_t first, size_t n)
+{
+	if (first >= count) return;
+	if (n > count - first) n = count - first;
+	size_t i = first, end = first + n;
+#ifdef VERTEXSTREAM_SSE
+	const __m128 tx = _mm_set1_ps(t.x), ty = _mm_set1_ps(t.y), tz = _mm_set1_ps(t.z);
+	for (; i + VERTEXSTREAM_LANES <= end; i += VERTEXSTREAM_LANES) {
+		_mm_storeu_ps(xs + i, _mm_add_ps(_mm_loadu_ps(xs + i), tx));
+		_mm_storeu_ps(ys + i, _mm_add_ps(_mm_loadu_ps(ys + i), ty));
+		_mm_storeu_ps(zs + i, _mm_add_ps(_mm_loadu_ps(zs + i), tz));
+	}
+#endif
+	for (; i < end; i++) {
+		xs[i] += t.x;
+		ys[i] += t.y;
+		zs[i] += t.z;
+	}
+}
+
+void VertexStream::scale(const f32 s)
+{
+	size_t n = padded(count);
+#ifdef VERTEXSTREAM_SSE
+	const __m128 vs = _mm_set1_ps(s);
+	for (size_t i = 0; i < n; i += VERTEXSTREAM_LANES) {
+		_mm_store_ps(xs + i, _mm_mul_ps(_mm_load_ps(xs + i), vs));
+		_mm_store_ps(ys + i, _mm_mul_ps(_mm_load_ps(ys + i), vs));
+		_mm_store_ps(zs + i, _mm_mul_ps(_mm_load_ps(zs + i), vs));
+	}
+#else
+	for (size_t i = 0; i < n; i++) {
+		xs[i] *= s;
+		ys[i] *= s;
+		zs[i] *= s;
+	}
+#endif
+}
+
+void VertexStream::normalize(size_t first)
+{
+	size_t i = first;
+#ifdef VERTEXSTREAM_SSE
+	// full-precision sqrt/div rather than rsqrt so results match mesh_v3::normalize
+	for (; i + VERTEXSTREAM_LANES <= count; i += VERTEXSTREAM_LANES) {
+		__m128 x = _mm_loadu_ps(xs + i);
+		__m128 y = _mm_loadu_ps(ys + i);
+		__m128 z = _mm_loadu_ps(zs + i);
+		__m128 m = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		_mm_storeu_ps(xs + i, _mm_div_ps(x, m));
+		_mm_storeu_ps(ys + i, _mm_div_ps(y, m));
+		_mm_storeu_ps(zs + i, _mm_div_ps(z, m));
+	}
+#endif
+	for (; i < count; i++) {
+		f32 m = sqrtf(xs[i] * xs[i] + ys[i] * ys[i] + zs[i] * zs[i]);
+		xs[i] /= m;
+		ys[i] /= m;
+		zs[i] /= m;
+	}
+}
+
+void VertexStream::generateUVs(size_t first, size_t n, const f32 vecs[2][4], const f32 w, const f32 h, mesh_v2* out) const
+{
+	// dot product of the texture's basis plus its offset
+	size_t i = 0;
+	const f32* X = xs + first;
+	const f32* Y = ys + first;
+	const f32* Z = zs + first;
+#ifdef VERTEXSTREAM_SSE
+	const __m128 s0 = _mm_set1_ps(vecs[0][0]), s1 = _mm_set1_ps(vecs[0][1]);
+	const __m128 s2 = _mm_set1_ps(vecs[0][2]), s3 = _mm_set1_ps(vecs[0][3]);
+	const __m128 t0 = _mm_set1_ps(vecs[1][0]), t1 = _mm_set1_ps(vecs[1][1]);
+	const __m128 t2 = _mm_set1_ps(vecs[1][2]), t3 = _mm_set1_ps(vecs[1][3]);
+	const __m128 vw = _mm_set1_ps(w), vh = _mm_set1_ps(h);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	for (; i + VERTEXSTREAM_LANES <= n; i += VERTEXSTREAM_LANES) {
+		__m128 x = _mm_loadu_ps(X + i);
+		__m128 y = _mm_loadu_ps(Y + i);
+		__m128 z = _mm_loadu_ps(Z + i);
+		__m128 u = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(x, s0), _mm_mul_ps(y, s1)), _mm_mul_ps(z, s2)), s3), vw);
+		__m128 v = _mm_xor_ps(_mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(x, t0), _mm_mul_ps(y, t1)), _mm_mul_ps(z, t2)), t3), vh), sign);
+		// interleave into the AoS texcoord stream
+		_mm_storeu_ps((f32*)(out + i), _mm_unpacklo_ps(u, v));
+		_mm_storeu_ps((f32*)(out + i + 2), _mm_unpackhi_ps(u, v));
+	}
+#endif
+	for (; i < n; i++) {
+		out[i].x = ((X[i] * vecs[0][0]) + (Y[i] * vecs[0][1]) + (Z[i] * vecs[0][2]) + vecs[0][3]) / w;
+		out[i].y = -(((X[i] * vecs[1][0]) + (Y[i] * vecs[1][1]) + (Z[i] * vecs[1][2]) + vecs[1][3]) / h);
+	}
+}
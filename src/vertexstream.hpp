@@ -0,0 +1,83 @@
+#ifndef VERTEXSTREAM_H_INCLUDED
+#define VERTEXSTREAM_H_INCLUDED
+
+#include "common.h"
+#include <stddef.h>
+#include <iterator>
+
+struct mesh_v2;
+struct mesh_v3;
+
+#define VERTEXSTREAM_ALIGN 16
+#define VERTEXSTREAM_LANES 4
+
+// Structure-of-arrays storage for 3-component vectors. Each component lives in
+// its own aligned stream, padded to a multiple of VERTEXSTREAM_LANES so the
+// geometry kernels can run whole SIMD blocks without a scalar remainder.
+//
+// The subscript/push_back/iterator interface returns mesh_v3 by value, so code
+// written against std::vector<mesh_v3> keeps working as an AoS view.
+class VertexStream {
+	f32* xs = nullptr;
+	f32* ys = nullptr;
+	f32* zs = nullptr;
+	size_t count = 0;
+	size_t cap = 0;
+
+	bool grow(size_t mincap);
+	void release();
+
+public:
+	VertexStream();
+	~VertexStream();
+	VertexStream(const VertexStream& other) = delete;
+	VertexStream& operator=(const VertexStream& other) = delete;
+	VertexStream(VertexStream&& other);
+	VertexStream& operator=(VertexStream&& other);
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	void reserve(size_t n);
+	void clear() { count = 0; }
+	void truncate(size_t n) { if (n < count) count = n; }
+	void push_back(const mesh_v3& v);
+	mesh_v3 operator[](size_t i) const;
+	void set(size_t i, const mesh_v3& v);
+
+	f32* x() { return xs; }
+	f32* y() { return ys; }
+	f32* z() { return zs; }
+	const f32* x() const { return xs; }
+	const f32* y() const { return ys; }
+	const f32* z() const { return zs; }
+
+	// kernels; all of them are vectorized when SSE is available
+	void bounds(mesh_v3* minp, mesh_v3* maxp) const;
+	void transform(const f32* m); // upper 3x3 of a column-major 4x4
+	void translate(const mesh_v3& t, size_t first = 0, size_t n = (size_t)-1);
+	void scale(const f32 s);
+	void normalize(size_t first = 0); // to unit length, from first on
+	void generateUVs(size_t first, size_t n, const f32 vecs[2][4], const f32 w, const f32 h, mesh_v2* out) const;
+
+	class const_iterator {
+		const VertexStream* s;
+		size_t i;
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef mesh_v3 value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const mesh_v3* pointer;
+		typedef mesh_v3 reference;
+
+		const_iterator(const VertexStream* S, size_t I) : s(S), i(I) { }
+		mesh_v3 operator*() const;
+		const_iterator& operator++() { ++i; return *this; }
+		bool operator!=(const const_iterator& o) const { return i != o.i; }
+		bool operator==(const const_iterator& o) const { return i == o.i; }
+	};
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, count); }
+};
+
+#endif